@@ -4,6 +4,8 @@ tcc \
 	-lssl \
 	-lcrypto \
 	-lsqlite3 \
+	-lz \
+	-lpthread \
 	-D MG_ENABLE_OPENSSL=1 \
 	-D MG_ENABLE_LOG=0 \
 	main.c \
@@ -1,13 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <sqlite3.h>
+#include <zlib.h>
 
 #include "termbox.h"
 #include "mongoose.h"
@@ -21,11 +24,104 @@
 #define DB_PATH "slack.db"
 // #define DB_PATH ":memory:"
 
+// Input buffers are written back to the database after this long without typing
+#define INPUT_PERSIST_IDLE_MS 500
+// Number of edits that can be undone in each input buffer
+#define UNDO_DEPTH 100
+
+// Time spent processing state updates per main loop iteration, before
+// going back to handle input and render
+#define STATE_UPDATE_BUDGET_MS 8
+
+// While the terminal isn't focused, wait longer for input and render at
+// most once per UNFOCUSED_FRAME_MS
+#define UNFOCUSED_POLL_MS 100
+#define UNFOCUSED_FRAME_MS 1000
+
+// Typing indicators disappear this long after the last user_typing event
+#define TYPING_TIMEOUT_MS 5000
+// Presence and typing changes are drawn at most this often
+#define INDICATOR_REPAINT_MS 250
+// Wait for the users on screen to settle before changing presence_sub
+#define PRESENCE_SUB_DELAY_MS 1000
+
+// Read markers are sent to slack this long after a conversation is read,
+// or straight away when switching to another conversation
+#define READ_MARK_DWELL_MS 3000
+
+// Longer messages are split, slack rejects anything over about 4000
+#define MESSAGE_CHUNK_MAX 3900
+// Wait this long before connecting again after the websocket closes
+#define WS_RECONNECT_MS 5000
+
+// Going to a time that isn't cached fetches history up to this long after it
+#define HISTORY_SEEK_WINDOW_S (24 * 60 * 60)
+
+// Exported rows are written through a buffer this big, it's all an export
+// holds besides one page of history
+#define EXPORT_BUFFER_SIZE (64 * 1024)
+
+// An import commits after about this many rows
+#define IMPORT_BATCH_ROWS 200000
+
+// Archive files read ahead of the import, per worker
+#define IMPORT_FILES_PER_WORKER 4
+// Archive files claiming to be bigger than this, packed or not, are
+// skipped rather than trusted with an allocation
+#define ZIP_ENTRY_MAX (256 * 1024 * 1024)
+
+// How long a conversation has to stay selected before fetching its history,
+// so skimming through the list doesn't start a fetch for every one
+#define HISTORY_FETCH_DWELL_MS 300
+
+// Messages that wrap to more lines than this are collapsed to their first
+// lines until expanded, 0 shows everything. SLACK_COLLAPSE_LINES overrides.
+#define COLLAPSE_LINES 20
+
+#define COLLAPSED_NOTE "... more, e to expand"
+
+// Message times are formatted once per minute and day, see set_layout_time()
+#define TIME_FORMAT_CACHE 256
+#define DAY_FORMAT_CACHE 16
+
+// Wrapped message layouts kept in memory, in hash buckets by message id
+#define LAYOUT_CACHE_BUCKETS 1024
+#define LAYOUT_CACHE_MAX 5000
+
+// CPU heavy work runs on up to this many threads, one less than the
+// number of cores
+#define WORKER_THREADS_MAX 8
+// Messages wrapped per task when laying out a screen on the workers,
+// only done when at least LAYOUT_PARALLEL_MIN are missing from the cache
+#define LAYOUT_TASK_BATCH 16
+#define LAYOUT_PARALLEL_MIN 8
+// Cached layouts for an old width are rewrapped in the background once
+// the width has stayed the same this long, so dragging a window edge
+// doesn't start a batch for every size on the way
+#define RELAYOUT_SETTLE_MS 200
+// They're looked up and handed out this many at a time, one batch per
+// RELAYOUT_SLICE_MS, so the main thread never stalls on the whole cache
+#define RELAYOUT_SLICE 256
+#define RELAYOUT_SLICE_MS 10
+
+// The message area splits into at most this many panes
+#define PANES_MAX 4
+
+// Shown in a pane instead of a conversation id for the unread timeline
+#define UNREADS_CONVERSATION "*unreads"
+
+// Latency histograms have power of two buckets in microseconds, the
+// last bucket holds everything slower
+#define LATENCY_BUCKETS 20
+
 // Formatting
 #define CHANS_WIDTH 20
+#define TIME_WIDTH 6
 #define USER_WIDTH 10
 
 // Theme colours 
+#define CLEAR_FG 232
+#define CLEAR_BG 255
 #define STATUSLINE_FG 232
 #define STATUSLINE_BG 255
 #define TEXTBOX_FG 232
@@ -40,8 +136,14 @@
 #define USER_BG 255
 #define MESSAGE_FG 232
 #define MESSAGE_FG_UNACKED 245
+#define MESSAGE_FG_FAILED 160
 #define MESSAGE_BG 255
 #define MESSAGE_BG_ALT 254
+#define PRESENCE_ACTIVE_FG 40
+#define REACTION_FG 238
+#define TIME_FG 245
+#define DAY_SEPARATOR_FG 238
+#define DAY_SEPARATOR_BG 253
 
 /*
  * Errors are written to this file, rather than a stdin/out since those 
@@ -87,6 +189,9 @@ FILE* dbgfile;
 // Set to true to terminate the main loop gracefully
 bool quit;
 
+// The cli export runs without the terminal
+bool terminal_started;
+
 // notification of application state change
 struct state_update {
 	// SQLITE_INSERT, SQLITE_UPDATE, SQLITE_DELETE
@@ -120,23 +225,534 @@ void free_state_update(struct state_update* u) {
 // add notification to this queue of type state_update
 list_t state_update_queue;
 
+// Updates made while handling user input go here instead, and are
+// processed ahead of anything in state_update_queue
+list_t input_update_queue;
+bool handling_input;
+
+void queue_state_update(struct state_update* u) {
+	list_append(handling_input ? &input_update_queue : &state_update_queue, u);
+}
+
+// The update that will be processed next, or NULL
+struct state_update* peek_state_update() {
+	struct state_update* u = list_get_at(&input_update_queue, 0);
+	return u != NULL ? u : list_get_at(&state_update_queue, 0);
+}
+
+struct state_update* next_state_update() {
+	struct state_update* u = list_extract_at(&input_update_queue, 0);
+	return u != NULL ? u : list_extract_at(&state_update_queue, 0);
+}
+
+// Request a render when nothing in the database has changed
+void request_render() {
+	queue_state_update(database_update("", 0, "", -1));
+}
+
+// Whether the terminal has focus, see TB_INPUT_FOCUS
+bool focused = true;
+
+bool state_updates_pending() {
+	return list_size(&input_update_queue) > 0 || list_size(&state_update_queue) > 0;
+}
+
 // Listeners for application state changes
 list_t state_listeners;
 
+// Counts of how long something took, bucket i holds durations
+// under 2^i microseconds
+struct histogram {
+	unsigned long counts[LATENCY_BUCKETS];
+	unsigned long total_us;
+};
+
+struct histogram state_update_latency;
+struct histogram input_latency;
+struct histogram render_latency;
+
+unsigned long layout_cache_hits;
+unsigned long layout_cache_misses;
+
+unsigned long micros() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000UL + t.tv_nsec / 1000;
+}
+
+void record_latency(struct histogram* h, unsigned long us) {
+	int i = 0;
+	while (i < LATENCY_BUCKETS - 1 && us >= (1UL << i)) {
+		i++;
+	}
+	h->counts[i]++;
+	h->total_us += us;
+}
+
+/*
+ * CPU heavy work runs on a small pool of worker threads. Each worker has
+ * its own deque of tasks, it takes the newest from its own and steals the
+ * oldest from the others when that runs out. Finished tasks go on a
+ * stack, and their done callbacks are run back on the main thread by
+ * run_completed_tasks(), so only they may touch the main thread's
+ * connections or UI state.
+ */
+struct task {
+	void (*run)(void* arg);
+	void (*done)(void* arg);
+	void* arg;
+	// Whoever waits for the task with wait_for_tasks, NULL if nobody does
+	int* batch;
+	struct task* next;
+};
+
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	list_t tasks;
+};
+
+struct worker workers[WORKER_THREADS_MAX];
+int workers_len;
+int next_worker;
+
+// Tasks waiting in any deque, workers sleep on pool_wake while it's 0
+int tasks_queued;
+bool pool_stopping;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+
+// Finished tasks, newest first
+struct task* completed_tasks;
+pthread_mutex_t completed_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t task_completed = PTHREAD_COND_INITIALIZER;
+
+// Submitted tasks whose done callback hasn't run yet, main thread only
+int tasks_in_flight;
+
+// Tasks running on threads of their own, see submit_long_task
+int long_tasks_running;
+pthread_cond_t long_task_done = PTHREAD_COND_INITIALIZER;
+
+struct task* take_task(int self) {
+	for (int i=0; i<workers_len; i++) {
+		struct worker* w = &workers[(self + i) % workers_len];
+		struct task* t = NULL;
+		pthread_mutex_lock(&w->lock);
+		int len = list_size(&w->tasks);
+		if (len > 0) {
+			t = list_extract_at(&w->tasks, i == 0 ? len - 1 : 0);
+		}
+		pthread_mutex_unlock(&w->lock);
+		if (t != NULL) {
+			pthread_mutex_lock(&pool_lock);
+			tasks_queued--;
+			pthread_mutex_unlock(&pool_lock);
+			return t;
+		}
+	}
+	return NULL;
+}
+
+// Takes a queued task of the batch, from whichever deque it's in
+struct task* take_batch_task(int* batch) {
+	for (int i=0; i<workers_len; i++) {
+		struct worker* w = &workers[i];
+		struct task* t = NULL;
+		pthread_mutex_lock(&w->lock);
+		for (int j=0; j<list_size(&w->tasks); j++) {
+			struct task* queued = list_get_at(&w->tasks, j);
+			if (queued->batch == batch) {
+				t = list_extract_at(&w->tasks, j);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&w->lock);
+		if (t != NULL) {
+			pthread_mutex_lock(&pool_lock);
+			tasks_queued--;
+			pthread_mutex_unlock(&pool_lock);
+			return t;
+		}
+	}
+	return NULL;
+}
+
+void complete_task(struct task* t) {
+	pthread_mutex_lock(&completed_lock);
+	t->next = completed_tasks;
+	completed_tasks = t;
+	pthread_cond_signal(&task_completed);
+	pthread_mutex_unlock(&completed_lock);
+}
+
+void* run_worker(void* arg) {
+	int self = (int)(intptr_t)arg;
+	while (true) {
+		struct task* t = take_task(self);
+		if (t != NULL) {
+			t->run(t->arg);
+			complete_task(t);
+			continue;
+		}
+		pthread_mutex_lock(&pool_lock);
+		while (tasks_queued == 0 && !pool_stopping) {
+			pthread_cond_wait(&pool_wake, &pool_lock);
+		}
+		bool stop = pool_stopping;
+		pthread_mutex_unlock(&pool_lock);
+		if (stop) {
+			return NULL;
+		}
+	}
+}
+
+void start_workers() {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	workers_len = MIN(MAX(cores - 1, 1), WORKER_THREADS_MAX);
+	for (int i=0; i<workers_len; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		list_init(&workers[i].tasks);
+		if (pthread_create(&workers[i].thread, NULL, run_worker, (void*)(intptr_t)i) != 0) {
+			fprintf(errfile, "could not start worker thread %d\n", i);
+			workers_len = i;
+			break;
+		}
+	}
+}
+
+void stop_workers() {
+	pthread_mutex_lock(&pool_lock);
+	pool_stopping = true;
+	pthread_cond_broadcast(&pool_wake);
+	pthread_mutex_unlock(&pool_lock);
+	for (int i=0; i<workers_len; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	pthread_mutex_lock(&pool_lock);
+	while (long_tasks_running > 0) {
+		pthread_cond_wait(&long_task_done, &pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * Runs run(arg) on a worker, then done(arg) on the main thread. done can
+ * be NULL. A task that's waited for with wait_for_tasks(batch) has to
+ * count batch down in done.
+ */
+void submit_batch_task(void (*run)(void*), void (*done)(void*), void* arg, int* batch) {
+	struct task* t = malloc(sizeof(struct task));
+	t->run = run;
+	t->done = done;
+	t->arg = arg;
+	t->batch = batch;
+	tasks_in_flight++;
+	if (workers_len == 0) {
+		run(arg);
+		complete_task(t);
+		return;
+	}
+	struct worker* w = &workers[next_worker];
+	next_worker = (next_worker + 1) % workers_len;
+	pthread_mutex_lock(&w->lock);
+	list_append(&w->tasks, t);
+	pthread_mutex_unlock(&w->lock);
+	pthread_mutex_lock(&pool_lock);
+	tasks_queued++;
+	pthread_cond_signal(&pool_wake);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void submit_task(void (*run)(void*), void (*done)(void*), void* arg) {
+	submit_batch_task(run, done, arg, NULL);
+}
+
+void* run_long_task(void* arg) {
+	struct task* t = arg;
+	t->run(t->arg);
+	complete_task(t);
+	pthread_mutex_lock(&pool_lock);
+	long_tasks_running--;
+	pthread_cond_signal(&long_task_done);
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+/*
+ * Like submit_task, but on a thread of its own, for work that takes
+ * seconds, like an export, and would hold up the layouts queued behind it
+ * on a worker. stop_workers waits for these too.
+ */
+void submit_long_task(void (*run)(void*), void (*done)(void*), void* arg) {
+	struct task* t = malloc(sizeof(struct task));
+	t->run = run;
+	t->done = done;
+	t->arg = arg;
+	t->batch = NULL;
+	tasks_in_flight++;
+	pthread_mutex_lock(&pool_lock);
+	long_tasks_running++;
+	pthread_mutex_unlock(&pool_lock);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, run_long_task, t) != 0) {
+		run_long_task(t);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/*
+ * Unlinks the finished tasks of batch, or all of them if batch is NULL,
+ * oldest first. The others stay where they are. Caller holds
+ * completed_lock.
+ */
+struct task* take_completed_tasks(int* batch) {
+	struct task* taken = NULL;
+	struct task** t = &completed_tasks;
+	while (*t != NULL) {
+		if (batch == NULL || (*t)->batch == batch) {
+			struct task* next = (*t)->next;
+			(*t)->next = taken;
+			taken = *t;
+			*t = next;
+		} else {
+			t = &(*t)->next;
+		}
+	}
+	return taken;
+}
+
+// Runs the done callbacks of tasks from take_completed_tasks, in order
+void run_task_callbacks(struct task* t) {
+	while (t != NULL) {
+		struct task* next = t->next;
+		tasks_in_flight--;
+		if (t->done != NULL) {
+			t->done(t->arg);
+		}
+		free(t);
+		t = next;
+	}
+}
+
+// Runs done callbacks for finished tasks in the order they finished
+bool run_completed_tasks() {
+	pthread_mutex_lock(&completed_lock);
+	struct task* t = take_completed_tasks(NULL);
+	pthread_mutex_unlock(&completed_lock);
+	run_task_callbacks(t);
+	return t != NULL;
+}
+
+/*
+ * Waits for the done callbacks to count remaining down to 0, helping
+ * out with the batch's queued tasks meanwhile. Anything else queued is
+ * left to the workers, so the wait is never longer than the batch, and
+ * anything else finished is left to the main loop, so no other done
+ * callback runs in the middle of whatever is waiting.
+ */
+void wait_for_tasks(int* remaining) {
+	while (*remaining > 0) {
+		struct task* t = take_batch_task(remaining);
+		if (t != NULL) {
+			t->run(t->arg);
+			complete_task(t);
+			continue;
+		}
+		pthread_mutex_lock(&completed_lock);
+		t = take_completed_tasks(remaining);
+		// The rest are running, sleep rather than spin on a core they need
+		while (t == NULL) {
+			pthread_cond_wait(&task_completed, &completed_lock);
+			t = take_completed_tasks(remaining);
+		}
+		pthread_mutex_unlock(&completed_lock);
+		run_task_callbacks(t);
+	}
+}
+
 // All slack data and UI state is stored in sqlite 
 sqlite3* db;
+// render() reads through its own connection, from one snapshot per
+// frame. Both connections belong to the main thread. Other threads open
+// connections of their own, like write_export and the import parsers.
+sqlite3* read_db;
+
+// Set by --check-query-plans, see check_query_plan()
+bool check_query_plans;
+list_t checked_queries;
+list_t query_plan_violations;
+
+// Every statement the app runs, defined above main
+extern const char** statement_table[];
+extern int statement_table_len;
+
+bool query_checked(const char* sql, int n) {
+	for (int i=0; i<list_size(&checked_queries); i++) {
+		const char* q = list_get_at(&checked_queries, i);
+		if (n < 0 ? strcmp(q, sql) == 0 : strncmp(q, sql, n) == 0 && q[n] == '\0') {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Reports a statement that reads a whole table or sorts into a temporary
+ * b-tree. Statements that really need every row say so with a
+ * "full scan" comment in their sql. Each distinct statement is only
+ * checked once.
+ */
+void check_query_plan(sqlite3* db, const char* sql, int n) {
+	if (query_checked(sql, n)) {
+		return;
+	}
+	char* text = n < 0 ? strdup(sql) : strndup(sql, n);
+	list_append(&checked_queries, text);
+	if (strstr(text, "/* full scan */") != NULL) {
+		return;
+	}
+	char* explain = sqlite3_mprintf("explain query plan %s", text);
+	sqlite3_stmt* stmt;
+	if (sqlite3_prepare_v2(db, explain, -1, &stmt, NULL) != SQLITE_OK) {
+		// Not a statement with a plan, like begin or create table
+		sqlite3_free(explain);
+		return;
+	}
+	// CTEs and subqueries are listed before they're scanned, and
+	// scanning them is fine since they were already filtered
+	char derived[16][64];
+	int derived_len = 0;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char* detail = sqlite3_column_text(stmt, 3);
+		char name[64] = "";
+		if (sscanf(detail, "MATERIALIZE %63s", name) == 1
+				|| sscanf(detail, "CO-ROUTINE %63s", name) == 1) {
+			if (derived_len < 16) {
+				strcpy(derived[derived_len++], name);
+			}
+			continue;
+		}
+		bool table_scan = sscanf(detail, "SCAN %63s", name) == 1
+			&& name[0] != '('
+			&& strcmp(name, "CONSTANT") != 0
+			&& strstr(detail, " USING ") == NULL
+			&& strstr(detail, "VIRTUAL TABLE") == NULL;
+		for (int i=0; table_scan && i<derived_len; i++) {
+			table_scan = strcmp(derived[i], name) != 0;
+		}
+		bool temp_sort = strstr(detail, "USE TEMP B-TREE") != NULL;
+		if (table_scan || temp_sort) {
+			list_append(&query_plan_violations, 
+					sqlite3_mprintf("%s\n  in: %s", detail, text));
+		}
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_free(explain);
+}
+
+// Returns the exit status for --check-query-plans
+int report_query_plans() {
+	for (int i=0; i<list_size(&query_plan_violations); i++) {
+		printf("%s\n", (char*)list_get_at(&query_plan_violations, i));
+	}
+	printf("%u statements checked, %u query plan problems\n",
+			list_size(&checked_queries), list_size(&query_plan_violations));
+	return list_size(&query_plan_violations) > 0 ? 1 : 0;
+}
+
+// A statement missing from statement_table is never checked by --check-query-plans <db>
+void check_listed(const char* sql) {
+	if (query_checked(sql, -1)) {
+		return;
+	}
+	for (int i=0; i<statement_table_len; i++) {
+		if (strcmp(*statement_table[i], sql) == 0) {
+			return;
+		}
+	}
+	list_append(&query_plan_violations, 
+			sqlite3_mprintf("NOT IN statement_table\n  in: %s", sql));
+}
+
+// Checks each statement of a script, the way sqlite3_exec would run them
+void check_script(sqlite3* db, const char* sql) {
+	while (*sql != '\0') {
+		sqlite3_stmt* stmt;
+		const char* tail;
+		if (sqlite3_prepare_v2(db, sql, -1, &stmt, &tail) != SQLITE_OK) {
+			list_append(&query_plan_violations, 
+					sqlite3_mprintf("COULD NOT PREPARE %s\n  in: %s", sqlite3_errmsg(db), sql));
+			return;
+		}
+		if (stmt != NULL) {
+			check_query_plan(db, sql, tail - sql);
+			sqlite3_finalize(stmt);
+		}
+		sql = tail;
+	}
+}
+
+int prepare_statement(sqlite3* db, const char* sql, int n, sqlite3_stmt** stmt, const char** tail) {
+	if (check_query_plans) {
+		check_listed(sql);
+		check_query_plan(db, sql, n);
+	}
+	return sqlite3_prepare_v2(db, sql, n, stmt, tail);
+}
+
+/*
+ * sqlite3_exec for statements that bind nothing, checked like the
+ * prepared ones. Transactions, pragmas and schema changes have no plan
+ * to check and go straight to sqlite3_exec.
+ */
+int exec_statement(sqlite3* db, const char* sql) {
+	if (check_query_plans) {
+		check_listed(sql);
+		check_script(db, sql);
+	}
+	return sqlite3_exec(db, sql, NULL, NULL, NULL);
+}
 
 // UI state
 enum mode {
 	mode_normal = 0,
 	mode_insert = 1,
-	mode_search = 2
+	mode_search = 2,
+	mode_goto = 3,
+	mode_filter = 4,
+	mode_export = 5
+};
+
+// An undoable change to an input buffer
+struct edit {
+	bool insert; // otherwise a deletion
+	int pos;
+	int len;
+	u_int32_t* text;
 };
 
-// We'll use multiple input buffers
+/*
+ * We'll use multiple input buffers. Each is edited in memory as a gap
+ * buffer of unicode code points, the cursor is always at the start of the
+ * gap. The text is only written back to kvs after INPUT_PERSIST_IDLE_MS
+ * without typing, or when the mode changes. Search text is the exception,
+ * the conversation list is filtered on it as it's typed.
+ */
 struct input_buffer {
 	const char* buffer_key;
 	const char* cursor_key;
+	u_int32_t* chars;
+	int size;
+	int gap_start;
+	int gap_end;
+	struct edit edits[UNDO_DEPTH];
+	int edits_len;
+	// Typing extends the last edit until this is set
+	bool edit_sealed;
+	bool loaded;
+	bool dirty;
 };
 struct input_buffer message_input_buffer = {
 	.buffer_key = "message_input_buffer",
@@ -146,14 +762,38 @@ struct input_buffer search_input_buffer = {
 	.buffer_key = "search_input_buffer",
 	.cursor_key = "search_input_cursor_pos",
 };
+struct input_buffer goto_input_buffer = {
+	.buffer_key = "goto_input_buffer",
+	.cursor_key = "goto_input_cursor_pos",
+};
+struct input_buffer filter_input_buffer = {
+	.buffer_key = "filter_input_buffer",
+	.cursor_key = "filter_input_cursor_pos",
+};
+struct input_buffer export_input_buffer = {
+	.buffer_key = "export_input_buffer",
+	.cursor_key = "export_input_cursor_pos",
+};
 
 // Networking stuff
 static const char* slack_rtm_connect_url = "https://slack.com/api/rtm.connect";
 static const char* slack_conversations_list_url = "https://slack.com/api/conversations.list?types=public_channel,private_channel,mpim,im&limit=1000&exclude_archived=true";
 static const char* slack_users_list_url = "https://slack.com/api/users.list";
 static const char* slack_conversation_history_url = "https://slack.com/api/conversations.history?channel=%s";
+// The cursor has to be url encoded, see url_encode()
+static const char* slack_conversation_history_page_url = "https://slack.com/api/conversations.history?channel=%s&oldest=%s&latest=%s&inclusive=true&limit=1000&cursor=%s";
+static const char* slack_conversations_mark_url = "https://slack.com/api/conversations.mark?channel=%s&ts=%s";
 struct mg_mgr mgr;
 struct mg_connection* ws_connection;
+struct mg_timer history_fetch_timer;
+struct mg_timer input_persist_timer;
+struct mg_timer indicator_timer;
+struct mg_timer presence_sub_timer;
+struct mg_timer read_mark_timer;
+struct mg_timer relayout_timer;
+struct mg_timer relayout_slice_timer;
+struct mg_timer ws_reconnect_timer;
+bool read_mark_timer_armed;
 
 // For debug logging
 void dbg(const char* format, ...) { 
@@ -173,30 +813,76 @@ char* format_url1(const char* format, const char* p1) {
 	return res;
 }
 
+// Caller responsible for freeing
+char* format_url2(const char* format, const char* p1, const char* p2) { 
+	int max = strlen(format) + strlen(p1) + strlen(p2);
+	char* res = malloc(max);
+	snprintf(res, max, format, p1, p2);
+	return res;
+}
+
+// Caller responsible for freeing
+char* format_url3(const char* format, const char* p1, const char* p2, const char* p3) {
+	int max = strlen(format) + strlen(p1) + strlen(p2) + strlen(p3);
+	char* res = malloc(max);
+	snprintf(res, max, format, p1, p2, p3);
+	return res;
+}
+
+// Caller responsible for freeing
+char* format_url4(const char* format, const char* p1, const char* p2, const char* p3, const char* p4) {
+	int max = strlen(format) + strlen(p1) + strlen(p2) + strlen(p3) + strlen(p4);
+	char* res = malloc(max);
+	snprintf(res, max, format, p1, p2, p3, p4);
+	return res;
+}
+
+// Percent encodes everything but unreserved characters. Caller frees
+char* url_encode(const char* s) {
+	static const char* hex = "0123456789ABCDEF";
+	char* res = malloc(strlen(s) * 3 + 1);
+	char* out = res;
+	for (const unsigned char* c = (const unsigned char*)s; *c != '\0'; c++) {
+		if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9')
+				|| strchr("-._~", *c) != NULL) {
+			*out++ = *c;
+		} else {
+			*out++ = '%';
+			*out++ = hex[*c >> 4];
+			*out++ = hex[*c & 15];
+		}
+	}
+	*out = '\0';
+	return res;
+}
+
+static const char* set_key_value_sql =
+	"insert into kvs (key, value) "
+	"values (?, ?) "
+	"on conflict (key) "
+	"do update set value=excluded.value";
+
 /**
  * Singleton values (like UI selections, current user identity) are
  * stored in a special table of key-value pairs.
  */
 void set_key_value_int(const char* key, int value) {
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"insert into kvs (key, value) "
-				"values (?, ?) "
-				"on conflict (key) "
-				"do update set value=excluded.value", -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, set_key_value_sql, -1, &stmt, NULL));
 	sqlite_check(db, sqlite3_bind_text(stmt, 1, key, -1, NULL));
 	sqlite_check(db, sqlite3_bind_int(stmt, 2, value));
 	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
 	sqlite3_finalize(stmt);
 }
 
+static const char* get_key_value_sql =
+	"select value "
+	"from kvs "
+	"where key = ?";
+
 int get_key_value_int(const char* key, int default_val) {
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select value "
-				"from kvs "
-				"where key = ?"
-				, -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, get_key_value_sql, -1, &stmt, NULL));
 	sqlite_check(db, sqlite3_bind_text(stmt, 1, key, -1, NULL));
 	int res;
 	int v = sqlite3_step(stmt);
@@ -210,13 +896,14 @@ int get_key_value_int(const char* key, int default_val) {
 	return res;
 }
 
+static const char* get_key_by_rowid_sql =
+	"select key "
+	"from kvs "
+	"where rowid = ?";
+
 char* get_key_value_key_by_rowid(int rowid) {
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select key "
-				"from kvs "
-				"where rowid = ?"
-				, -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, get_key_by_rowid_sql, -1, &stmt, NULL));
 	sqlite_check(db, sqlite3_bind_int(stmt, 1, rowid));
 	char* res;
 	int v = sqlite3_step(stmt);
@@ -231,11 +918,7 @@ char* get_key_value_key_by_rowid(int rowid) {
 }
 void set_key_value_string(const char* key, char* value) {
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"insert into kvs (key, value) "
-				"values (?, ?) "
-				"on conflict (key) "
-				"do update set value=excluded.value", -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, set_key_value_sql, -1, &stmt, NULL));
 	sqlite_check(db, sqlite3_bind_text(stmt, 1, key, -1, NULL));
 	sqlite_check(db, sqlite3_bind_text(stmt, 2, value, -1, NULL));
 	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
@@ -245,11 +928,7 @@ void set_key_value_string(const char* key, char* value) {
 // Caller frees
 char* get_key_value_string(const char* key, char* default_value) {
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select value "
-				"from kvs "
-				"where key = ?"
-				, -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, get_key_value_sql, -1, &stmt, NULL));
 	sqlite_check(db, sqlite3_bind_text(stmt, 1, key, -1, NULL));
 	char* res;
 	int v = sqlite3_step(stmt);
@@ -280,12 +959,13 @@ char* get_current_user_id() {
 	return get_key_value_string("current_user_id", NULL);
 }
 
+static const char* count_conversations_sql =
+	"select count(1) "
+	"from conversation_list ";
+
 int count_conversations() {
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select count(1) "
-				"from conversation_list ", 
-				-1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, count_conversations_sql, -1, &stmt, NULL));
 	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
 	int count = sqlite3_column_int(stmt, 0);
 	sqlite3_finalize(stmt);
@@ -305,8 +985,6 @@ void set_conversation_window_start(int new_window_start) {
 	if (new_window_start < 0) {
 		return;
 	}
-	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, "", -1, &stmt, NULL));
 	set_key_value_int("conversation_window_start", new_window_start);
 }
 int get_conversation_window_start() {
@@ -318,17 +996,23 @@ const char* mode_desc() {
 		case mode_normal: return "normal";
 		case mode_insert: return "insert";
 		case mode_search: return "search";
+		case mode_goto: return "go to (yyyy-mm-dd [hh:mm] or hh:mm)";
+		case mode_filter: return get_key_value_int("filter_everywhere", 0)
+			? "filter every channel by user (empty for everyone)"
+			: "filter channel by user (empty for everyone)";
+		case mode_export: return "export to (file [yyyy-mm-dd [yyyy-mm-dd]], .jsonl for json lines)";
 		default: return "none";
 	}
 }
 
 
+static const char* conversation_selection_pos_sql =
+	"select idx from conversation_list where id = ? ";
+
 int get_conversation_selection_pos() {
 	char* selected_conversation = get_selected_conversation();
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select idx from conversation_list where id = ? "
-				, -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, conversation_selection_pos_sql, -1, &stmt, NULL));
 	sqlite_check(db, sqlite3_bind_text(stmt, 1, selected_conversation, -1, NULL));
 	int v = sqlite3_step(stmt);
 	int res = 0;
@@ -342,14 +1026,16 @@ int get_conversation_selection_pos() {
 	return res;
 }
 
+static const char* first_conversation_sql =
+	"select id "
+	"from conversation_list "
+	"order by display_name "
+	"limit 1";
+
 void select_first_conversation() {
 	const char* to_select = NULL;
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-			"select id "
-			"from conversation_list "
-			"order by display_name "
-			"limit 1", -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, first_conversation_sql, -1, &stmt, NULL));
 	int v = sqlite3_step(stmt);
 	if (v == SQLITE_ROW) {
 		to_select = sqlite3_column_text(stmt, 0);
@@ -363,18 +1049,22 @@ void select_first_conversation() {
 	sqlite3_finalize(stmt);
 }
 
+static const char* next_conversation_sql =
+	"select next "
+	"from conversation_list "
+	"where id = ?";
+static const char* prev_conversation_sql =
+	"select prev "
+	"from conversation_list "
+	"where id = ?";
+
 void select_conversation(bool next) {
-	char buf[200];
 	char* selected_conversation = get_selected_conversation();
-	sqlite3_stmt* stmt;
+	sqlite3_stmt* stmt = NULL;
 	if (selected_conversation != NULL) {
 		char* to_select = NULL;
-		snprintf(buf, 200, 
-			"select %s "
-			"from conversation_list "
-			"where id = ?", next ? "next" : "prev");
-		dbg("executing %s", buf);
-		sqlite_check(db, sqlite3_prepare_v2(db, buf, -1, &stmt, NULL));
+		sqlite_check(db, prepare_statement(db, 
+					next ? next_conversation_sql : prev_conversation_sql, -1, &stmt, NULL));
 		sqlite_check(db, sqlite3_bind_text(stmt, 1, selected_conversation, -1, NULL));
 		int v = sqlite3_step(stmt);
 		if (v == SQLITE_ROW) {
@@ -403,13 +1093,14 @@ void select_next_conversation() {
 	select_conversation(true);
 }
 
+static const char* get_did_fetch_sql =
+	"select did_fetch "
+	"from conversation "
+	"where id = ? ";
+
 bool get_conversation_did_fetch(const char* id) {
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select did_fetch "
-				"from conversation "
-				"where id = ? "
-				, -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, get_did_fetch_sql, -1, &stmt, NULL));
 	sqlite_check(db, sqlite3_bind_text(stmt, 1, id, -1, NULL));
 	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
 	int r = sqlite3_column_int(stmt, 0);
@@ -417,628 +1108,4430 @@ bool get_conversation_did_fetch(const char* id) {
 	return r;
 }
 
+static const char* set_did_fetch_sql =
+	"update conversation "
+	"set did_fetch = ? "
+	"where id = ? ";
+
 void set_conversation_did_fetch(const char* id, bool did_fetch) {
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"update conversation "
-				"set did_fetch = ? "
-				"where id = ? "
-				, -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, set_did_fetch_sql, -1, &stmt, NULL));
 	sqlite_check(db, sqlite3_bind_int(stmt, 1, did_fetch));
 	sqlite_check(db, sqlite3_bind_text(stmt, 2, id, -1, NULL));
 	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
 	sqlite3_finalize(stmt);
 }
 
-// function pointer indicates size of elements in list
-list_t* new_copying_list(size_t (*meter)(const void*)) {
-	list_t* res = malloc(sizeof(list_t));
-	list_init(res);
-	list_attributes_copy(res, meter, true);
-	return res;
-}
-
-void list_of_lists_destroy(list_t* list) {
-	int size = list_size(list);
-	for (int i=0; i<size; i++) {
-		list_destroy((list_t*)list_get_at(list, i));
-	}
-	list_destroy(list);
-	free(list);
+int input_buffer_len(struct input_buffer* b) {
+	return b->size - (b->gap_end - b->gap_start);
 }
 
-size_t u_int32_size(const void* data) {
-	return sizeof(u_int32_t);
+u_int32_t input_buffer_char_at(struct input_buffer* b, int i) {
+	return i < b->gap_start ? b->chars[i] : b->chars[i + b->gap_end - b->gap_start];
 }
 
-size_t list_t_size(const void* data) {
-	return sizeof(list_t);
+int get_input_cursor_pos(struct input_buffer* b) {
+	return b->gap_start;
 }
 
-list_t* to_utf8_list(const char* str) {
-	list_t* res = new_copying_list(u_int32_size);
-	int i=0;
-	u_int32_t u;
-	while (str[i] != '\0') {
-		i += tb_utf8_char_to_unicode(&u, &str[i]);
-		list_append(res, &u);
+// Moves the gap, and so the cursor, to pos
+void set_input_cursor_pos(int pos, struct input_buffer* b) {
+	if (pos < 0 || pos > input_buffer_len(b)) {
+		return;
 	}
-	return res;
+	if (pos < b->gap_start) {
+		int n = b->gap_start - pos;
+		memmove(&b->chars[b->gap_end - n], &b->chars[pos], n * sizeof(u_int32_t));
+		b->gap_start -= n;
+		b->gap_end -= n;
+	} else if (pos > b->gap_start) {
+		int n = pos - b->gap_start;
+		memmove(&b->chars[b->gap_start], &b->chars[b->gap_end], n * sizeof(u_int32_t));
+		b->gap_start += n;
+		b->gap_end += n;
+	}
+	b->edit_sealed = true;
+	b->dirty = true;
 }
 
-char* to_char_array(list_t* lst) {
-	char buf[1000];
-	int size = list_size(lst);
-	int i;
-	for (i=0; i<size; ) {
-		u_int32_t* ch = list_get_at(lst, i);
-		i += tb_utf8_unicode_to_char(&buf[i], *ch);
+void ensure_input_buffer_gap(struct input_buffer* b, int needed) {
+	int gap = b->gap_end - b->gap_start;
+	if (gap >= needed) {
+		return;
 	}
-	buf[i] = '\0';
-	return strdup(buf);
+	int new_size = MAX(b->size * 2, b->size - gap + needed + 64);
+	int tail = b->size - b->gap_end;
+	b->chars = realloc(b->chars, new_size * sizeof(u_int32_t));
+	memmove(&b->chars[new_size - tail], &b->chars[b->gap_end], tail * sizeof(u_int32_t));
+	b->gap_end = new_size - tail;
+	b->size = new_size;
 }
 
-void set_input_buffer(list_t* lst, struct input_buffer b) {
-	char* ib = to_char_array(lst);
-	set_key_value_string(b.buffer_key, ib);
-	free(ib);
-}
-list_t* get_input_buffer(struct input_buffer b) {
-	char* str = get_key_value_string(b.buffer_key, "");
-	list_t* ret = to_utf8_list(str);
-	free(str);
-	return ret;
+// Inserts at the cursor, leaving the cursor after the inserted text
+void input_buffer_insert_raw(struct input_buffer* b, const u_int32_t* text, int len) {
+	ensure_input_buffer_gap(b, len);
+	memcpy(&b->chars[b->gap_start], text, len * sizeof(u_int32_t));
+	b->gap_start += len;
+	b->dirty = true;
 }
 
-void set_input_cursor_pos(int n, struct input_buffer b) {
-	list_t* input_buffer = get_input_buffer(b);
-	int max = list_size(input_buffer);
-	list_destroy(input_buffer);
-	if (n < 0) {
-		return;
-	} else if (n > max) {
-		return;
-	}
-	set_key_value_int(b.cursor_key, n);
+// Deletes len characters starting at pos, leaving the cursor at pos
+void input_buffer_delete_raw(struct input_buffer* b, int pos, int len) {
+	set_input_cursor_pos(pos, b);
+	b->gap_end += len;
+	b->dirty = true;
 }
-int get_input_cursor_pos(struct input_buffer b) {
-	return get_key_value_int(b.cursor_key, 0);
+
+void free_edit(struct edit* e) {
+	free(e->text);
 }
 
-int wordlen(list_t* str, int start){
-	int str_len = list_size(str);
-	int i=start;
-	for (; i<str_len; i++) {
-		u_int32_t* u = list_get_at(str, i);
-		if (*u == ' ' || *u == '\n') {
-			break;
-		}
-		i++;
+void clear_undo_history(struct input_buffer* b) {
+	for (int i=0; i<b->edits_len; i++) {
+		free_edit(&b->edits[i]);
 	}
-	return i-start;
+	b->edits_len = 0;
 }
 
-/**
- * Inspired by https://stackoverflow.com/questions/22582989/word-wrap-program-c
- * Returns a list of lists.
- */
-list_t* wrap(list_t* input, const int wrapline){
-	list_t* result = new_copying_list(list_t_size);
-	list_t* line = new_copying_list(u_int32_size);
-	int input_len = list_size(input);
-	for (int i=0; i<input_len;) {
-		u_int32_t* ch = list_get_at(input, i);
-		int line_len = list_size(line);
-		if (*ch == '\n') {
-			list_append(result, line);
-			line = new_copying_list(u_int32_size);
-			i++;
-		} else if (*ch == ' ') {
-			// break nicely on spaces
-			if (line_len + wordlen(input, i+1) >= wrapline) {
-				list_append(result, line);
-				line = new_copying_list(u_int32_size);
+/*
+ * Remember an edit so it can be undone. Typing a word, or deleting
+ * character by character, is collapsed into a single edit.
+ */
+void record_edit(struct input_buffer* b, bool insert, int pos, const u_int32_t* text, int len) {
+	struct edit* last = b->edits_len > 0 ? &b->edits[b->edits_len-1] : NULL;
+	if (last != NULL && !b->edit_sealed && last->insert == insert) {
+		if (insert && pos == last->pos + last->len) {
+			last->text = realloc(last->text, (last->len + len) * sizeof(u_int32_t));
+			memcpy(&last->text[last->len], text, len * sizeof(u_int32_t));
+			last->len += len;
+			return;
+		} else if (!insert && (pos == last->pos || pos + len == last->pos)) {
+			last->text = realloc(last->text, (last->len + len) * sizeof(u_int32_t));
+			if (pos == last->pos) {
+				// delete key, text follows what was already deleted
+				memcpy(&last->text[last->len], text, len * sizeof(u_int32_t));
 			} else {
-				list_append(line, ch);
+				// backspace, text precedes it
+				memmove(&last->text[len], last->text, last->len * sizeof(u_int32_t));
+				memcpy(last->text, text, len * sizeof(u_int32_t));
+				last->pos = pos;
 			}
-			i++;
-		} else if (line_len >= wrapline) {
-			// forcibly break overly long words
-			list_append(result, line);
-			line = new_copying_list(u_int32_size);
-			// don't increment i!
-		} else {
-			list_append(line, ch);
-			i++;
+			last->len += len;
+			return;
 		}
 	}
-	list_append(result, line);
-	return result;
+	if (b->edits_len == UNDO_DEPTH) {
+		free_edit(&b->edits[0]);
+		memmove(&b->edits[0], &b->edits[1], (UNDO_DEPTH-1) * sizeof(struct edit));
+		b->edits_len--;
+	}
+	struct edit* e = &b->edits[b->edits_len++];
+	e->insert = insert;
+	e->pos = pos;
+	e->len = len;
+	e->text = malloc(len * sizeof(u_int32_t));
+	memcpy(e->text, text, len * sizeof(u_int32_t));
+	b->edit_sealed = false;
 }
 
-void render_char(u_int32_t ch, int x, int y, int fg, int bg) {
-	struct tb_cell c = {
-		.ch = ch,
-		.fg = fg,
-		.bg = bg,
-	};
-	tb_put_cell(x, y, &c);
+void insert_input_buffer(u_int32_t ch, struct input_buffer* b) {
+	record_edit(b, true, b->gap_start, &ch, 1);
+	input_buffer_insert_raw(b, &ch, 1);
+	// Spaces end the word, so undo works a word at a time
+	b->edit_sealed = ch == ' ' || ch == '\n';
 }
 
-void render() {
-	tb_clear();
-	int width = tb_width();
-	int height = tb_height();
-	
-	int bottom_pos = 1;
-
-	// Write the input buffer
-	struct input_buffer b;
-	int mode = get_current_mode();
-	switch (mode) {
-		case mode_normal:
-		case mode_insert:
-			b = message_input_buffer;
-			break;
-		case mode_search:
-			b = search_input_buffer;
-			break;
+bool delete_input_buffer(int pos, int len, struct input_buffer* b) {
+	if (pos < 0 || len <= 0 || pos + len > input_buffer_len(b)) {
+		return false;
 	}
-	list_t* input_buffer = get_input_buffer(b);
-	int cursor_pos = get_input_cursor_pos(b);
-	int input_buffer_len = list_size(input_buffer);
-	for (int i=0; i<MIN(width, input_buffer_len); i++) {
-		u_int32_t* ch = list_get_at(input_buffer, i);
-		render_char(*ch, i, height-bottom_pos,
-				TEXTBOX_FG, TEXTBOX_BG);
+	u_int32_t* text = malloc(len * sizeof(u_int32_t));
+	for (int i=0; i<len; i++) {
+		text[i] = input_buffer_char_at(b, pos+i);
 	}
-	tb_set_cursor(cursor_pos, height-bottom_pos);
-	bottom_pos++;
-
-	// Write the status line	
-	const char* md = mode_desc();
-	int mdl = strlen(md);
-	for (int i=0; i<MIN(width, mdl); i++) {
-		render_char(md[i], i, height-bottom_pos,
-				STATUSLINE_FG, STATUSLINE_BG);
-	}
-	bottom_pos++;
+	bool sealed = b->edit_sealed;
+	input_buffer_delete_raw(b, pos, len);
+	b->edit_sealed = sealed;
+	record_edit(b, false, pos, text, len);
+	free(text);
+	return true;
+}
 
-	// Recalculate the display for channels list
-	int max_chans = height - (bottom_pos-1);
-	int conversation_selection_pos = get_conversation_selection_pos();
-	int conversation_window_start = get_conversation_window_start();
-	if ((conversation_selection_pos - conversation_window_start) >= max_chans) {
-		set_conversation_window_start(conversation_selection_pos - (max_chans-1));
-	} else if (conversation_selection_pos < conversation_window_start) {
-		set_conversation_window_start(conversation_selection_pos);
+void undo_input_buffer(struct input_buffer* b) {
+	if (b->edits_len == 0) {
+		return;
+	}
+	struct edit* e = &b->edits[--b->edits_len];
+	if (e->insert) {
+		input_buffer_delete_raw(b, e->pos, e->len);
+	} else {
+		set_input_cursor_pos(e->pos, b);
+		input_buffer_insert_raw(b, e->text, e->len);
 	}
+	free_edit(e);
+	b->edit_sealed = true;
+}
 
-	const char* selected_conversation_id = get_selected_conversation();
-	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select id, display_name "
-				"from conversation_list "
-				"order by display_name "
-				"limit ? "
-				"offset ? ", -1, &stmt, NULL));
-	sqlite_check(db, sqlite3_bind_int(stmt, 1, max_chans));
-	sqlite_check(db, sqlite3_bind_int(stmt, 2, conversation_window_start))
+bool is_word_char(u_int32_t ch) {
+	return ch != ' ' && ch != '\n' && ch != '\t';
+}
 
-	bool more = true;
-	for (int j=0; j<max_chans; j++) {
-		const char* id = "";
-		const char* name = "";
-		if (more) {
-			int v = sqlite3_step(stmt);
-			if (v == SQLITE_DONE) {
-				more = false;
-			} else if (v == SQLITE_ROW) {
-				id = sqlite3_column_text(stmt, 0);
-				name = sqlite3_column_text(stmt, 1);
-			} else {
-				sqlite_check(db, v);
-			}
-		} 
-		bool selected = selected_conversation_id != NULL && strcmp(id, selected_conversation_id) == 0;
-		int namelen = strlen(name);
-		for (int i=0; i<CHANS_WIDTH; i++) {
-			char ch = i<namelen ? name[i] : ' ';
-			int fg = selected ? CHANNELS_FG_SELECTED : CHANNELS_FG;
-			int bg = selected ? CHANNELS_BG_SELECTED : CHANNELS_BG;
-			render_char(ch, i, j, fg, bg);
-		}
+// Start of the word before the cursor
+int prev_word_pos(struct input_buffer* b) {
+	int i = b->gap_start;
+	while (i > 0 && !is_word_char(input_buffer_char_at(b, i-1))) {
+		i--;
 	}
-	sqlite3_finalize(stmt);
-
-	// Write the message list
-	int max_messages = height - (bottom_pos-1);
-	int user_start_x = CHANS_WIDTH;
-	int message_start_x = CHANS_WIDTH + USER_WIDTH;
-	int message_width = width - message_start_x;
-	if (selected_conversation_id != NULL) {
-		sqlite_check(db, sqlite3_prepare_v2(db, 
-					"select u.name, m.user, m.text, m.acknowledged "
-					"from message m "
-					"left join user u "
-					  "on u.id = m.user "
-					"where conversation = ? "
-					"order by ts desc", -1, &stmt, NULL));
-		sqlite_check(db, sqlite3_bind_text(stmt, 1, selected_conversation_id, -1, NULL));
-		more = true;
-		int msg_bg_col = MESSAGE_BG;
-		int j = max_messages - 1;
-		while (j >= 0) {
-			if (more) {
-				int v = sqlite3_step(stmt);
-				if (v == SQLITE_DONE) {
-					more = false;
-				} else if (v == SQLITE_ROW) {
-					const char* user = sqlite3_column_text(stmt, 0);
-					if (user == NULL) {
-						user = sqlite3_column_text(stmt, 1);
-					}
-					if (user == NULL) {
-						user = "unknown!";
-					}
-					const char* text = sqlite3_column_text(stmt, 2);
-					bool acked = sqlite3_column_int(stmt, 3);
-					list_t* ll = to_utf8_list(text);
-					list_t* lines = wrap(ll, message_width);
-					list_destroy(ll);
-					free(ll);
-
-					int lines_len = list_size(lines);
-					for (int k=0; k<lines_len; k++) {
-						list_t* line = list_get_at(lines, k);
-						int line_len = list_size(line);
-						int y = (j-lines_len) + 1 + k;
+	while (i > 0 && is_word_char(input_buffer_char_at(b, i-1))) {
+		i--;
+	}
+	return i;
+}
 
-						const char* usrstr = k == 0 ? user : "";
-						int usrstrlen = strlen(usrstr);
-						// Add 1 padding for readability here.
-						for (int i=1; i<USER_WIDTH; i++) {
-							char ch = (i-1) < usrstrlen ? usrstr[i-1] : ' ';
-							int x = i + user_start_x;
-							render_char(ch, i+user_start_x, y, USER_FG, msg_bg_col);
-						}
+// Start of the word after the cursor
+int next_word_pos(struct input_buffer* b) {
+	int len = input_buffer_len(b);
+	int i = b->gap_start;
+	while (i < len && is_word_char(input_buffer_char_at(b, i))) {
+		i++;
+	}
+	while (i < len && !is_word_char(input_buffer_char_at(b, i))) {
+		i++;
+	}
+	return i;
+}
 
-						for (int i=0; i<message_width; i++) {
-							u_int32_t ch;
-							if (i < line_len) {
-								ch = *((u_int32_t*)list_get_at(line, i));
-							} else {
-								ch = ' ';
-							}
-							int x = i + message_start_x;
-							render_char(ch, x, y, acked ? MESSAGE_FG : MESSAGE_FG_UNACKED, msg_bg_col);
-						}
-					}
-					list_of_lists_destroy(lines);
-					j -= lines_len;
-					// toggle the background colour between messages
-					msg_bg_col = msg_bg_col == MESSAGE_BG ? MESSAGE_BG_ALT : MESSAGE_BG;
-				} else {
-					sqlite_check(db, v);
-				}
-			} else {
-				for (int i=0; i<USER_WIDTH; i++) {
-					render_char(' ', i+user_start_x, j, USER_FG, USER_BG);
-				}
-				for (int i=0; i<message_width; i++) {
-					render_char(' ', i+message_start_x, j, MESSAGE_FG, MESSAGE_BG);
-				}
-				j--;
-			}
-		}
-		free((void*)selected_conversation_id);
-		sqlite3_finalize(stmt);
+// Caller frees
+char* input_buffer_to_utf8(struct input_buffer* b) {
+	int len = input_buffer_len(b);
+	// 6 bytes is the longest sequence tb_utf8_unicode_to_char writes
+	char* res = malloc(len * 6 + 1);
+	int j = 0;
+	for (int i=0; i<len; i++) {
+		j += tb_utf8_unicode_to_char(&res[j], input_buffer_char_at(b, i));
 	}
+	res[j] = '\0';
+	return res;
+}
 
-	tb_present();
+void clear_input_buffer(struct input_buffer* b) {
+	b->gap_start = 0;
+	b->gap_end = b->size;
+	clear_undo_history(b);
+	b->dirty = true;
 }
 
-void handle_event_mode_normal(struct tb_event* evt) {
-	switch (evt->ch) {
-	case 'i':
-		set_current_mode(mode_insert);
-		return;
-	case '/': 
-		set_current_mode(mode_search);
-		return;
-	case 'w': 
-		select_previous_conversation();
-		return;
-	case 's':
-		select_next_conversation();
-		return;
-	case 'q': 
-		quit = true;
-		return;
-	default:
-		return;
+// Reads the input buffer back from kvs the first time it's used
+struct input_buffer* load_input_buffer(struct input_buffer* b) {
+	if (b->loaded) {
+		return b;
+	}
+	b->loaded = true;
+	char* str = get_key_value_string(b->buffer_key, "");
+	for (int i=0; str[i] != '\0';) {
+		u_int32_t u;
+		i += tb_utf8_char_to_unicode(&u, &str[i]);
+		input_buffer_insert_raw(b, &u, 1);
 	}
+	free(str);
+	set_input_cursor_pos(get_key_value_int(b->cursor_key, 0), b);
+	b->dirty = false;
+	return b;
 }
 
-bool delete_input_buffer(int pos, struct input_buffer b) {
-	list_t* ib = get_input_buffer(b);
-	
-	if (list_size(ib) <= pos) {
-		list_destroy(ib);
-		return false;
-	} else if (pos < 0) {
-		return false;
+void persist_input_buffer(struct input_buffer* b) {
+	if (!b->dirty) {
+		return;
 	}
-	void* ch = list_get_at(ib, pos);
-	list_delete_at(ib, pos);
-	set_input_buffer(ib, b);
-	list_destroy(ib);
-	return true;
+	char* str = input_buffer_to_utf8(b);
+	set_key_value_string(b->buffer_key, str);
+	set_key_value_int(b->cursor_key, b->gap_start);
+	free(str);
+	b->dirty = false;
 }
 
-void insert_input_buffer(u_int32_t ch, struct input_buffer b) {
-	list_t* ib = get_input_buffer(b);
-	int input_cursor_pos = get_input_cursor_pos(b);
-	list_insert_at(ib, &ch, input_cursor_pos);
-	set_input_buffer(ib, b);
-	list_destroy(ib);
+void persist_input_buffers(void* arg) {
+	persist_input_buffer(&message_input_buffer);
+	persist_input_buffer(&search_input_buffer);
+	persist_input_buffer(&goto_input_buffer);
+	persist_input_buffer(&filter_input_buffer);
+	persist_input_buffer(&export_input_buffer);
 }
 
-void send_pending_messages(struct state_update su) {
-	if (ws_connection == NULL) {
-		return;
+// Write the input buffers back once typing pauses
+void schedule_persist_input_buffers() {
+	mg_timer_free(&input_persist_timer);
+	mg_timer_init(&input_persist_timer, INPUT_PERSIST_IDLE_MS, 0,
+			persist_input_buffers, NULL);
+}
+
+/*
+ * Names for @user and #channel completion, kept sorted case insensitively
+ * so a prefix lookup is a binary search. Built from the user and
+ * conversation tables, and kept up to date by update_completion_indexes.
+ */
+struct completion_entry {
+	char* name;
+	sqlite3_int64 rowid;
+};
+struct completion_index {
+	const char* tablename;
+	// Selects rowid, name
+	const char* select_sql;
+	// The same for one rowid
+	const char* select_one_sql;
+	struct completion_entry* entries;
+	int len;
+	int cap;
+	// Rebuild rather than update incrementally
+	bool stale;
+};
+struct completion_index user_completions = {
+	.tablename = "user",
+	.select_sql = "select /* full scan */ rowid, name from user where name is not null",
+	.select_one_sql = "select rowid, name from user where name is not null and rowid = ?",
+	.stale = true,
+};
+struct completion_index channel_completions = {
+	.tablename = "conversation",
+	.select_sql = "select /* full scan */ rowid, name from conversation where name is not null and is_im is not 1",
+	.select_one_sql = "select rowid, name from conversation where name is not null and is_im is not 1 and rowid = ?",
+	.stale = true,
+};
+
+// Tab cycles through matches while this is active
+struct completion_state {
+	bool active;
+	int start; // position of the text after @ or #
+	int len;   // length of the completion inserted last
+	int index; // of the last match in the completion index
+	char* prefix;
+	struct completion_index* idx;
+} completion;
+
+int compare_completion_entries(const void* a, const void* b) {
+	return strcasecmp(((struct completion_entry*)a)->name,
+			((struct completion_entry*)b)->name);
+}
+
+void completion_index_clear(struct completion_index* idx) {
+	for (int i=0; i<idx->len; i++) {
+		free(idx->entries[i].name);
 	}
-	if (strcmp(su.tablename, "message") != 0) {
-		return;
+	idx->len = 0;
+}
+
+void completion_index_append(struct completion_index* idx, sqlite3_int64 rowid, const char* name) {
+	if (idx->len == idx->cap) {
+		idx->cap = MAX(idx->cap * 2, 64);
+		idx->entries = realloc(idx->entries, idx->cap * sizeof(struct completion_entry));
 	}
-	if (su.operation != SQLITE_INSERT) {
-		return;
+	idx->entries[idx->len].rowid = rowid;
+	idx->entries[idx->len].name = strdup(name);
+	idx->len++;
+}
+
+// First entry not less than prefix, i.e. the first possible match
+int completion_index_lower_bound(struct completion_index* idx, const char* prefix) {
+	int lo = 0;
+	int hi = idx->len;
+	size_t prefix_len = strlen(prefix);
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (strncasecmp(idx->entries[mid].name, prefix, prefix_len) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
-	// Find unsent messages
+	return lo;
+}
+
+bool completion_matches(struct completion_index* idx, int i, const char* prefix) {
+	return i < idx->len && strncasecmp(idx->entries[i].name, prefix, strlen(prefix)) == 0;
+}
+
+void completion_index_rebuild(struct completion_index* idx) {
+	completion_index_clear(idx);
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select json_object("
-					"'id', id, "
-					"'channel', conversation, "
-					"'type', 'message', "
-					"'text', text "
-				") from message where pending = 1", -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, idx->select_sql, -1, &stmt, NULL));
 	int v;
 	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
-		const char* payload = sqlite3_column_text(stmt, 0);
-		dbg("sending message %s", payload);
-		mg_ws_send(ws_connection, payload, strlen(payload), WEBSOCKET_OP_TEXT);
+		completion_index_append(idx, sqlite3_column_int64(stmt, 0), sqlite3_column_text(stmt, 1));
 	}
 	if (v != SQLITE_DONE) {
 		sqlite_check(db, v);
 	}
 	sqlite3_finalize(stmt);
-	sqlite_check(db, sqlite3_exec(db, "update message set pending = 0 where pending = 1", NULL, NULL, NULL));
-	sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
+	qsort(idx->entries, idx->len, sizeof(struct completion_entry), compare_completion_entries);
+	idx->stale = false;
 }
 
-bool send_message(struct input_buffer b) {
-	char* current_user_id = get_current_user_id();
-	if (ws_connection == NULL 
-	  || current_user_id == NULL) {
-		return false;
+void completion_index_remove(struct completion_index* idx, sqlite3_int64 rowid) {
+	for (int i=0; i<idx->len; i++) {
+		if (idx->entries[i].rowid == rowid) {
+			free(idx->entries[i].name);
+			memmove(&idx->entries[i], &idx->entries[i+1], 
+					(idx->len - i - 1) * sizeof(struct completion_entry));
+			idx->len--;
+			return;
+		}
 	}
-	list_t* ib = get_input_buffer(b);
+}
 
-	char ts[12];
-	time_t t = time(NULL);
-	snprintf(ts, 12, "%ld", t);
-	char* text = to_char_array(ib);
-	const char* selected_conversation_id = get_selected_conversation();
+void completion_index_add(struct completion_index* idx, sqlite3_int64 rowid) {
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, "insert into message (conversation, type, user, text, ts, pending, acknowledged) "
-				"values (?, ?, ?, ?, ?, ?, ?)", -1, &stmt, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 1, selected_conversation_id, -1, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 2, "message", -1, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 3, current_user_id, -1, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 4, text, -1, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 5, ts, -1, NULL));
-	sqlite_check(db, sqlite3_bind_int(stmt, 6, 1));
-	sqlite_check(db, sqlite3_bind_int(stmt, 7, 0));
-	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite_check(db, prepare_statement(db, idx->select_one_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_int64(stmt, 1, rowid));
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		const char* name = sqlite3_column_text(stmt, 1);
+		// Append, then shift into place
+		completion_index_append(idx, rowid, name);
+		struct completion_entry e = idx->entries[--idx->len];
+		int pos = completion_index_lower_bound(idx, name);
+		idx->len++;
+		memmove(&idx->entries[pos+1], &idx->entries[pos], 
+				(idx->len - 1 - pos) * sizeof(struct completion_entry));
+		idx->entries[pos] = e;
+	} else if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
 	sqlite3_finalize(stmt);
+}
 
-	free((void*)selected_conversation_id);
-	free(current_user_id);
-	free(text);
-	list_destroy(ib);
+/*
+ * Wrapping a message is much more work than drawing it, so wrapped lines
+ * are cached by message id and only recomputed when the message changes
+ * (see invalidate_layouts) or the width does. Reactions are drawn on their
+ * own line under the layout, so they never invalidate it.
+ */
+struct layout {
+	sqlite3_int64 message_id;
+	int width;
+	int lines_len;
+	u_int32_t** lines;
+	int* line_lens;
+	// Wrapping stops at collapse_lines unless expanded, collapsed says
+	// there was more
+	bool expanded;
+	bool collapsed;
+	// When the message was sent, see set_layout_time()
+	long minute;
+	char time[TIME_WIDTH];
+	int day;
+	struct layout* next;
+};
+struct layout* layout_cache[LAYOUT_CACHE_BUCKETS];
+int layout_cache_len;
+int collapse_lines = COLLAPSE_LINES;
+// Newest message drawn collapsed in the last render, what 'e' expands
+sqlite3_int64 newest_collapsed_visible;
 
-	return true;
-}
+/*
+ * Turning a slack ts into a time and a day takes localtime and strftime,
+ * so the results are cached by minute, and by day for the labels drawn
+ * between messages from different days. A ts doesn't change once slack
+ * has acknowledged the message, so layouts keep a copy of the time and
+ * render never formats one.
+ */
+struct time_format {
+	bool used;
+	long minute;
+	char time[TIME_WIDTH];
+	int day;
+};
+struct time_format time_formats[TIME_FORMAT_CACHE];
+
+struct day_format {
+	bool used;
+	int day;
+	char label[40];
+};
+struct day_format day_formats[DAY_FORMAT_CACHE];
 
-void clear_input_buffer(struct input_buffer b) {
-	list_t* lst = new_copying_list(0);
-	set_input_buffer(lst, b);
-	set_input_cursor_pos(0, b);
+void set_layout_time(struct layout* l, const char* ts) {
+	long minute = (ts == NULL ? 0 : atol(ts)) / 60;
+	struct time_format* f = &time_formats[minute % TIME_FORMAT_CACHE];
+	if (!f->used || f->minute != minute) {
+		time_t t = minute * 60;
+		struct tm tm;
+		localtime_r(&t, &tm);
+		f->used = true;
+		f->minute = minute;
+		strftime(f->time, TIME_WIDTH, "%H:%M", &tm);
+		f->day = (tm.tm_year + 1900) * 1000 + tm.tm_yday;
+	}
+	l->minute = minute;
+	memcpy(l->time, f->time, TIME_WIDTH);
+	l->day = f->day;
 }
 
-void handle_editor(list_t* buffer,
-		int* cursor_pos,
-		const char* buffer_variable_name,
-		const char* cursor_pos_variable_name) {
+const char* day_label(int day, long minute) {
+	struct day_format* d = &day_formats[day % DAY_FORMAT_CACHE];
+	if (!d->used || d->day != day) {
+		time_t t = minute * 60;
+		struct tm tm;
+		localtime_r(&t, &tm);
+		d->used = true;
+		d->day = day;
+		// Day of the month without padding, which strftime can't portably do
+		char format[20];
+		snprintf(format, sizeof(format), "%%A %d %%B %%Y", tm.tm_mday);
+		strftime(d->label, sizeof(d->label), format, &tm);
+	}
+	return d->label;
+}
 
+void free_layout_lines(struct layout* l) {
+	for (int i=0; i<l->lines_len; i++) {
+		free(l->lines[i]);
+	}
+	free(l->lines);
+	free(l->line_lens);
 }
 
-void update_input_buffer(struct tb_event* evt, 
-		struct input_buffer b,
-		void (*enter_callback)(struct input_buffer b)) {
-	sqlite3_str* str = sqlite3_str_new(db);
-	int input_cursor_pos = get_input_cursor_pos(b);
-	list_t* ib = get_input_buffer(b);
-	if (evt->key == TB_KEY_ARROW_LEFT) {
-		set_input_cursor_pos(input_cursor_pos-1, b);
-	} else if (evt->key == TB_KEY_ARROW_RIGHT) {
-		set_input_cursor_pos(input_cursor_pos+1, b);
-	} else if (evt->key == TB_KEY_HOME) {
-		set_input_cursor_pos(0, b);
-	} else if (evt->key == TB_KEY_END) {
-		set_input_cursor_pos(list_size(ib), b);
-	} else if (evt->key == TB_KEY_BACKSPACE 
-	        || evt->key == TB_KEY_BACKSPACE2) {
-		if (delete_input_buffer(input_cursor_pos-1, b)) {
-			set_input_cursor_pos(input_cursor_pos-1, b);
-		}
-	} else if (evt->key == TB_KEY_DELETE) {
-		delete_input_buffer(input_cursor_pos, b);
-		if (list_size(ib) < input_cursor_pos) {
-			set_input_cursor_pos(input_cursor_pos-1, b);
-		}
-	} else if (evt->key == TB_KEY_ENTER) {
-		enter_callback(b);
-	} else {
-		char ch;
-		if (evt->key == TB_KEY_SPACE) {
-			ch = ' ';
-		} else {
-			ch = evt->ch;
+void clear_layout_cache() {
+	for (int i=0; i<LAYOUT_CACHE_BUCKETS; i++) {
+		struct layout* next;
+		for (struct layout* l = layout_cache[i]; l != NULL; l = next) {
+			next = l->next;
+			free_layout_lines(l);
+			free(l);
 		}
-		insert_input_buffer(ch, b);
-		set_input_cursor_pos(input_cursor_pos+1, b);
+		layout_cache[i] = NULL;
 	}
-	list_destroy(ib);
+	layout_cache_len = 0;
 }
 
-void send_and_clear(struct input_buffer b) {
-	if (send_message(b)) {
-		clear_input_buffer(b);
+void remove_layout(sqlite3_int64 message_id) {
+	struct layout** l = &layout_cache[message_id % LAYOUT_CACHE_BUCKETS];
+	for (; *l != NULL; l = &(*l)->next) {
+		if ((*l)->message_id == message_id) {
+			struct layout* found = *l;
+			*l = found->next;
+			free_layout_lines(found);
+			free(found);
+			layout_cache_len--;
+			return;
+		}
 	}
 }
 
-void handle_event_insert(struct tb_event* evt) {
-	update_input_buffer(evt, message_input_buffer, send_and_clear);
+// Characters up to the next space or line break, counting no further than limit
+int word_len(const char* p, int limit) {
+	int len = 0;
+	while (*p != '\0' && *p != ' ' && *p != '\n' && len < limit) {
+		p += tb_utf8_char_length(*p);
+		len++;
+	}
+	return len;
 }
 
-void handle_event_search(struct tb_event* evt) {
-	update_input_buffer(evt, search_input_buffer, send_and_clear);
+void end_layout_line(struct layout* l, int* lines_cap, u_int32_t* line, int* line_len) {
+	if (l->lines_len == *lines_cap) {
+		*lines_cap *= 2;
+		l->lines = realloc(l->lines, *lines_cap * sizeof(u_int32_t*));
+		l->line_lens = realloc(l->line_lens, *lines_cap * sizeof(int));
+	}
+	l->lines[l->lines_len] = malloc(MAX(*line_len, 1) * sizeof(u_int32_t));
+	memcpy(l->lines[l->lines_len], line, *line_len * sizeof(u_int32_t));
+	l->line_lens[l->lines_len] = *line_len;
+	l->lines_len++;
+	*line_len = 0;
 }
 
-void handle_event(struct tb_event* evt) {
-	if (evt->type == TB_EVENT_RESIZE) {
-		list_append(&state_update_queue, database_update("", 0, "", -1));
-		return;
-	}
-	if (evt->type == TB_EVENT_KEY) {
-		if (evt->key == TB_KEY_ESC) {
-			set_current_mode(mode_normal);
-			return;
+/*
+ * Wraps text to width, breaking on spaces where it can. Unless the layout
+ * is expanded it stops after collapse_lines lines and marks it collapsed
+ * if there was more, so a huge message costs no more than a short one.
+ */
+void compute_layout(struct layout* l, const char* text, int width) {
+	width = MAX(width, 1);
+	int max_lines = l->expanded ? 0 : collapse_lines;
+	int lines_cap = 4;
+	l->width = width;
+	l->collapsed = false;
+	l->lines_len = 0;
+	l->lines = malloc(lines_cap * sizeof(u_int32_t*));
+	l->line_lens = malloc(lines_cap * sizeof(int));
+	u_int32_t* line = malloc(width * sizeof(u_int32_t));
+	int line_len = 0;
+	const char* p = text;
+	while (*p != '\0') {
+		u_int32_t ch;
+		int n = tb_utf8_char_to_unicode(&ch, p);
+		if (ch == '\n') {
+			end_layout_line(l, &lines_cap, line, &line_len);
+			p += n;
+		} else if (ch == ' ') {
+			// break nicely on spaces
+			if (line_len + word_len(p + n, width) >= width) {
+				end_layout_line(l, &lines_cap, line, &line_len);
+			} else {
+				line[line_len++] = ch;
+			}
+			p += n;
+		} else if (line_len >= width) {
+			// forcibly break overly long words, without consuming ch
+			end_layout_line(l, &lines_cap, line, &line_len);
+		} else {
+			line[line_len++] = ch;
+			p += n;
 		}
-		switch (get_current_mode()) {
-		case mode_normal:
-			handle_event_mode_normal(evt);
-			return;
-		case mode_insert:
-			handle_event_insert(evt);
-			return;
-		case mode_search:
-			handle_event_search(evt);
-			return;
+		if (max_lines > 0 && l->lines_len == max_lines && *p != '\0') {
+			l->collapsed = true;
+			break;
 		}
 	}
+	if (!l->collapsed) {
+		end_layout_line(l, &lines_cap, line, &line_len);
+	}
+	free(line);
 }
 
-/*
- * Handles initializing TLS and adding the relevant AUTHORIZATION header
- */
+struct layout* find_layout(sqlite3_int64 message_id) {
+	struct layout* l = layout_cache[message_id % LAYOUT_CACHE_BUCKETS];
+	for (; l != NULL; l = l->next) {
+		if (l->message_id == message_id) {
+			return l;
+		}
+	}
+	return NULL;
+}
+
+// Adds a layout computed elsewhere, replacing any older one
+void put_layout(struct layout* l) {
+	remove_layout(l->message_id);
+	if (layout_cache_len >= LAYOUT_CACHE_MAX) {
+		clear_layout_cache();
+	}
+	l->next = layout_cache[l->message_id % LAYOUT_CACHE_BUCKETS];
+	layout_cache[l->message_id % LAYOUT_CACHE_BUCKETS] = l;
+	layout_cache_len++;
+}
+
+struct layout* get_layout(sqlite3_int64 message_id, const char* text, const char* ts,
+		bool expanded, int width) {
+	struct layout* l = find_layout(message_id);
+	if (l != NULL && l->width == width && l->expanded == expanded) {
+		layout_cache_hits++;
+		return l;
+	}
+	layout_cache_misses++;
+	if (l != NULL) {
+		free_layout_lines(l);
+	} else {
+		if (layout_cache_len >= LAYOUT_CACHE_MAX) {
+			clear_layout_cache();
+		}
+		l = malloc(sizeof(struct layout));
+		l->message_id = message_id;
+		l->next = layout_cache[message_id % LAYOUT_CACHE_BUCKETS];
+		layout_cache[message_id % LAYOUT_CACHE_BUCKETS] = l;
+		layout_cache_len++;
+	}
+	l->expanded = expanded;
+	compute_layout(l, text == NULL ? "" : text, width);
+	set_layout_time(l, ts);
+	return l;
+}
+
+struct layout_task {
+	int len;
+	int width;
+	struct layout* layouts[LAYOUT_TASK_BATCH];
+	char* texts[LAYOUT_TASK_BATCH];
+	// Counts down tasks someone is waiting for, NULL in the background
+	int* remaining;
+};
+
+// Width of the message pane in the last frame
+int layout_width;
+
+void run_layout_task(void* arg) {
+	struct layout_task* t = arg;
+	for (int i=0; i<t->len; i++) {
+		compute_layout(t->layouts[i], t->texts[i], t->width);
+	}
+}
+
+void finish_layout_task(void* arg) {
+	struct layout_task* t = arg;
+	for (int i=0; i<t->len; i++) {
+		struct layout* l = t->layouts[i];
+		struct layout* cached = find_layout(l->message_id);
+		// A background result is only wanted if the width is still the
+		// same and the message hasn't changed or been laid out since
+		if (t->remaining != NULL
+				|| (t->width == layout_width && cached != NULL && cached->width != t->width)) {
+			put_layout(l);
+		} else {
+			free_layout_lines(l);
+			free(l);
+		}
+		free(t->texts[i]);
+	}
+	if (t->remaining != NULL) {
+		(*t->remaining)--;
+	}
+	free(t);
+}
+
+void flush_layouts(struct layout_task** t) {
+	if (*t == NULL) {
+		return;
+	}
+	if ((*t)->remaining != NULL) {
+		(*(*t)->remaining)++;
+	}
+	submit_batch_task(run_layout_task, finish_layout_task, *t, (*t)->remaining);
+	*t = NULL;
+}
+
+// Hands out layouts to wrap in batches of LAYOUT_TASK_BATCH
+void submit_layout(struct layout_task** t, struct layout* l, char* text, int width, int* remaining) {
+	if (*t == NULL) {
+		*t = malloc(sizeof(struct layout_task));
+		(*t)->len = 0;
+		(*t)->width = width;
+		(*t)->remaining = remaining;
+	}
+	(*t)->layouts[(*t)->len] = l;
+	(*t)->texts[(*t)->len] = text;
+	(*t)->len++;
+	if ((*t)->len == LAYOUT_TASK_BATCH) {
+		flush_layouts(t);
+	}
+}
+
+struct layout* new_layout(sqlite3_int64 message_id, bool expanded) {
+	struct layout* l = malloc(sizeof(struct layout));
+	l->message_id = message_id;
+	l->expanded = expanded;
+	l->lines_len = 0;
+	l->lines = NULL;
+	l->line_lens = NULL;
+	return l;
+}
+
+static const char* message_text_sql =
+	"select text from message where id = ?";
+
+// The first bucket relayout_slice hasn't been through yet
+int relayout_next_bucket;
+
+/*
+ * Hands the stale layouts of the next few buckets to the workers, about
+ * RELAYOUT_SLICE of them. Returns whether any buckets are left.
+ */
+bool relayout_slice() {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, message_text_sql, -1, &stmt, NULL));
+	struct layout_task* t = NULL;
+	int submitted = 0;
+	while (relayout_next_bucket < LAYOUT_CACHE_BUCKETS && submitted < RELAYOUT_SLICE) {
+		struct layout* l = layout_cache[relayout_next_bucket++];
+		for (; l != NULL; l = l->next) {
+			if (l->width == layout_width) {
+				continue;
+			}
+			sqlite_check(db, sqlite3_bind_int64(stmt, 1, l->message_id));
+			int v = sqlite3_step(stmt);
+			if (v == SQLITE_ROW) {
+				const char* text = sqlite3_column_text(stmt, 0);
+				struct layout* relaid = new_layout(l->message_id, l->expanded);
+				relaid->minute = l->minute;
+				memcpy(relaid->time, l->time, TIME_WIDTH);
+				relaid->day = l->day;
+				submit_layout(&t, relaid, strdup(text == NULL ? "" : text), layout_width, NULL);
+				submitted++;
+			} else if (v != SQLITE_DONE) {
+				sqlite_check(db, v);
+			}
+			sqlite3_reset(stmt);
+		}
+	}
+	flush_layouts(&t);
+	sqlite3_finalize(stmt);
+	return relayout_next_bucket < LAYOUT_CACHE_BUCKETS;
+}
+
+void continue_relayout(void* arg) {
+	if (!focused || !relayout_slice()) {
+		mg_timer_free(&relayout_slice_timer);
+	}
+}
+
+/*
+ * Rewraps cached layouts left over from an old width, after a resize,
+ * on the workers. The cache is walked a slice per timer tick. Nothing
+ * waits for them, messages drawn before they're done are wrapped by
+ * get_layout.
+ */
+void relayout_cache(void* arg) {
+	mg_timer_free(&relayout_slice_timer);
+	relayout_next_bucket = 0;
+	// Picked up again when focus comes back
+	if (!focused) {
+		return;
+	}
+	if (relayout_slice()) {
+		mg_timer_init(&relayout_slice_timer, RELAYOUT_SLICE_MS, MG_TIMER_REPEAT,
+				continue_relayout, NULL);
+	}
+}
+
+static const char* prefetch_layouts_sql =
+	"select m.id, m.text, m.ts, e.ts is not null "
+	"from message m "
+	"left join expanded_message e "
+	  "on e.conversation = m.conversation "
+	  "and e.ts = m.ts "
+	"where m.conversation = ?1 "
+	"and (?2 is null or m.ts <= ?2) "
+	"order by m.ts desc "
+	"limit ?3";
+
+/*
+ * Wraps the newest count messages of a conversation, up to anchor if
+ * it's set, on the workers when
+ * enough of them are missing from the cache, like after a resize, so the
+ * render that follows only has cache hits.
+ */
+void prefetch_layouts(const char* conversation_id, const char* anchor, int count, int width) {
+	sqlite3_stmt* stmt;
+	sqlite_check(read_db, prepare_statement(read_db, prefetch_layouts_sql, -1, &stmt, NULL));
+	sqlite_check(read_db, sqlite3_bind_text(stmt, 1, conversation_id, -1, NULL));
+	sqlite_check(read_db, sqlite3_bind_text(stmt, 2, anchor, -1, NULL));
+	sqlite_check(read_db, sqlite3_bind_int(stmt, 3, count));
+	list_t missing;
+	list_init(&missing);
+	int v;
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+		bool expanded = sqlite3_column_int(stmt, 3);
+		struct layout* l = find_layout(id);
+		if (l != NULL && l->width == width && l->expanded == expanded) {
+			continue;
+		}
+		const char* text = sqlite3_column_text(stmt, 1);
+		l = new_layout(id, expanded);
+		set_layout_time(l, sqlite3_column_text(stmt, 2));
+		list_append(&missing, l);
+		list_append(&missing, strdup(text == NULL ? "" : text));
+	}
+	if (v != SQLITE_DONE) {
+		sqlite_check(read_db, v);
+	}
+	sqlite3_finalize(stmt);
+
+	int missing_len = list_size(&missing) / 2;
+	if (missing_len < LAYOUT_PARALLEL_MIN) {
+		// Not worth the round trip, get_layout will do these
+		for (int i=0; i<list_size(&missing); i++) {
+			free(list_get_at(&missing, i));
+		}
+		list_destroy(&missing);
+		return;
+	}
+	struct layout_task* t = NULL;
+	int remaining = 0;
+	for (int i=0; i<missing_len; i++) {
+		submit_layout(&t, list_get_at(&missing, i*2), list_get_at(&missing, i*2 + 1),
+				width, &remaining);
+	}
+	flush_layouts(&t);
+	list_destroy(&missing);
+	wait_for_tasks(&remaining);
+}
+
+/*
+ * render() draws into a frame, which is then copied to termbox and
+ * written to the terminal. With SLACK_RENDER_THREAD set that last part
+ * happens on its own thread, so a slow terminal never holds up input or
+ * network processing. A frame is never changed once published, and if
+ * frames come faster than the terminal takes them only the newest is
+ * drawn.
+ */
+struct frame {
+	int width;
+	int height;
+	struct tb_cell* cells;
+	int cursor_x;
+	int cursor_y;
+};
+
+// The frame render() is drawing into
+struct frame* frame;
+
+// Size of the terminal as of the last resize event, termbox's own idea
+// of it belongs to whoever presents
+int screen_width;
+int screen_height;
+
+bool render_thread_enabled;
+pthread_t render_thread;
+pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t frame_ready = PTHREAD_COND_INITIALIZER;
+struct frame* pending_frame;
+bool render_thread_stopping;
+
+struct frame* new_frame(int width, int height) {
+	struct frame* f = malloc(sizeof(struct frame));
+	f->width = width;
+	f->height = height;
+	f->cells = malloc(MAX(width * height, 1) * sizeof(struct tb_cell));
+	for (int i=0; i<width*height; i++) {
+		f->cells[i] = (struct tb_cell){.ch = ' ', .fg = CLEAR_FG, .bg = CLEAR_BG};
+	}
+	f->cursor_x = TB_HIDE_CURSOR;
+	f->cursor_y = TB_HIDE_CURSOR;
+	return f;
+}
+
+void free_frame(struct frame* f) {
+	free(f->cells);
+	free(f);
+}
+
+void draw_frame(struct frame* f) {
+	tb_clear();
+	tb_blit(0, 0, f->width, f->height, f->cells);
+	tb_set_cursor(f->cursor_x, f->cursor_y);
+	tb_present();
+}
+
+void* run_render_thread(void* arg) {
+	while (true) {
+		pthread_mutex_lock(&frame_lock);
+		while (pending_frame == NULL && !render_thread_stopping) {
+			pthread_cond_wait(&frame_ready, &frame_lock);
+		}
+		struct frame* f = pending_frame;
+		pending_frame = NULL;
+		pthread_mutex_unlock(&frame_lock);
+		if (f == NULL) {
+			return NULL;
+		}
+		draw_frame(f);
+		free_frame(f);
+	}
+}
+
+void start_render_thread() {
+	if (pthread_create(&render_thread, NULL, run_render_thread, NULL) != 0) {
+		fprintf(errfile, "could not start render thread\n");
+		return;
+	}
+	render_thread_enabled = true;
+}
+
+// Draws whatever was published last, then stops
+void stop_render_thread() {
+	if (!render_thread_enabled) {
+		return;
+	}
+	pthread_mutex_lock(&frame_lock);
+	render_thread_stopping = true;
+	pthread_cond_signal(&frame_ready);
+	pthread_mutex_unlock(&frame_lock);
+	pthread_join(render_thread, NULL);
+	render_thread_enabled = false;
+}
+
+void present_frame(struct frame* f) {
+	if (!render_thread_enabled) {
+		draw_frame(f);
+		free_frame(f);
+		return;
+	}
+	pthread_mutex_lock(&frame_lock);
+	if (pending_frame != NULL) {
+		free_frame(pending_frame);
+	}
+	pending_frame = f;
+	pthread_cond_signal(&frame_ready);
+	pthread_mutex_unlock(&frame_lock);
+}
+
+void render_char(u_int32_t ch, int x, int y, int fg, int bg) {
+	if (x < 0 || y < 0 || x >= frame->width || y >= frame->height) {
+		return;
+	}
+	frame->cells[y * frame->width + x] = (struct tb_cell){
+		.ch = ch,
+		.fg = fg,
+		.bg = bg,
+	};
+}
+
+void render_day_separator(const char* label, int x, int y, int width) {
+	int label_len = strlen(label);
+	int label_start = MAX((width - label_len) / 2, 0);
+	for (int i=0; i<width; i++) {
+		u_int32_t ch = 0x2500;
+		if (i == label_start - 1 || i == label_start + label_len) {
+			ch = ' ';
+		} else if (i >= label_start && i < label_start + label_len) {
+			ch = label[i - label_start];
+		}
+		render_char(ch, x+i, y, DAY_SEPARATOR_FG, DAY_SEPARATOR_BG);
+	}
+}
+
+/*
+ * Presence and typing events arrive far too often to be worth writing to
+ * the database, so they're kept in small tables in memory instead. Changes
+ * only mark the indicators dirty, indicator_tick repaints at a bounded rate.
+ */
+struct presence {
+	char* user;
+	bool active;
+};
+struct typing {
+	char* user;
+	char* conversation;
+	unsigned long expires;
+};
+struct presence* presences;
+int presences_len;
+struct typing* typings;
+int typings_len;
+bool indicators_dirty;
+
+void set_presence(const char* user, bool active) {
+	for (int i=0; i<presences_len; i++) {
+		if (strcmp(presences[i].user, user) == 0) {
+			indicators_dirty |= presences[i].active != active;
+			presences[i].active = active;
+			return;
+		}
+	}
+	presences = realloc(presences, (presences_len + 1) * sizeof(struct presence));
+	presences[presences_len].user = strdup(user);
+	presences[presences_len].active = active;
+	presences_len++;
+	indicators_dirty = true;
+}
+
+bool is_user_active(const char* user) {
+	for (int i=0; user != NULL && i<presences_len; i++) {
+		if (strcmp(presences[i].user, user) == 0) {
+			return presences[i].active;
+		}
+	}
+	return false;
+}
+
+void set_typing(const char* user, const char* conversation) {
+	unsigned long expires = mg_millis() + TYPING_TIMEOUT_MS;
+	for (int i=0; i<typings_len; i++) {
+		if (strcmp(typings[i].user, user) == 0
+		  && strcmp(typings[i].conversation, conversation) == 0) {
+			typings[i].expires = expires;
+			return;
+		}
+	}
+	typings = realloc(typings, (typings_len + 1) * sizeof(struct typing));
+	typings[typings_len].user = strdup(user);
+	typings[typings_len].conversation = strdup(conversation);
+	typings[typings_len].expires = expires;
+	typings_len++;
+	indicators_dirty = true;
+}
+
+// Drops expired typing indicators and repaints if anything changed
+void indicator_tick(void* arg) {
+	unsigned long now = mg_millis();
+	for (int i=0; i<typings_len; ) {
+		if (typings[i].expires <= now) {
+			free(typings[i].user);
+			free(typings[i].conversation);
+			typings[i] = typings[--typings_len];
+			indicators_dirty = true;
+		} else {
+			i++;
+		}
+	}
+	if (indicators_dirty) {
+		indicators_dirty = false;
+		request_render();
+	}
+}
+
+/*
+ * Users that were on screen in the last render. Presence events are only
+ * subscribed to for these, to keep the volume of them down.
+ */
+struct id_set {
+	char** ids;
+	int len;
+};
+
+void id_set_add(struct id_set* set, const char* id) {
+	if (id == NULL) {
+		return;
+	}
+	for (int i=0; i<set->len; i++) {
+		if (strcmp(set->ids[i], id) == 0) {
+			return;
+		}
+	}
+	set->ids = realloc(set->ids, (set->len + 1) * sizeof(char*));
+	set->ids[set->len++] = strdup(id);
+}
+
+// Caller frees with sqlite3_free
+char* id_set_to_json(struct id_set* set) {
+	sqlite3_str* str = sqlite3_str_new(db);
+	sqlite3_str_appendchar(str, 1, '[');
+	for (int i=0; i<set->len; i++) {
+		sqlite3_str_appendf(str, "%s\"%w\"", i > 0 ? "," : "", set->ids[i]);
+	}
+	sqlite3_str_appendchar(str, 1, ']');
+	return sqlite3_str_finish(str);
+}
+
+void id_set_clear(struct id_set* set) {
+	for (int i=0; i<set->len; i++) {
+		free(set->ids[i]);
+	}
+	free(set->ids);
+	set->ids = NULL;
+	set->len = 0;
+}
+
+char* visible_users_json;
+char* subscribed_users_json;
+
+void send_presence_sub(void* arg) {
+	if (ws_connection == NULL || visible_users_json == NULL) {
+		return;
+	}
+	if (subscribed_users_json != NULL
+	  && strcmp(visible_users_json, subscribed_users_json) == 0) {
+		return;
+	}
+	sqlite3_free(subscribed_users_json);
+	subscribed_users_json = sqlite3_mprintf("%s", visible_users_json);
+	char* payload = sqlite3_mprintf("{\"type\":\"presence_sub\",\"ids\":%s}", visible_users_json);
+	dbg("sending %s", payload);
+	mg_ws_send(ws_connection, payload, strlen(payload), WEBSOCKET_OP_TEXT);
+	sqlite3_free(payload);
+}
+
+void schedule_presence_sub() {
+	mg_timer_free(&presence_sub_timer);
+	mg_timer_init(&presence_sub_timer, PRESENCE_SUB_DELAY_MS, 0,
+			send_presence_sub, NULL);
+}
+
+// Takes ownership of the ids in visible
+void set_visible_users(struct id_set* visible) {
+	char* json = id_set_to_json(visible);
+	id_set_clear(visible);
+	if (visible_users_json != NULL && strcmp(json, visible_users_json) == 0) {
+		sqlite3_free(json);
+		return;
+	}
+	sqlite3_free(visible_users_json);
+	visible_users_json = json;
+	schedule_presence_sub();
+}
+
+static const char* typing_user_name_sql =
+	"select ifnull((select name from user where id = ?1), ?1)";
+
+// Writes "x is typing" etc. for the conversation, returns the length
+int typing_desc(const char* conversation, char* buf, int len) {
+	const char* names[2];
+	int count = 0;
+	buf[0] = '\0';
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, typing_user_name_sql, -1, &stmt, NULL));
+	for (int i=0; conversation != NULL && i<typings_len; i++) {
+		if (strcmp(typings[i].conversation, conversation) != 0) {
+			continue;
+		}
+		if (count < 2) {
+			sqlite3_reset(stmt);
+			sqlite_check(db, sqlite3_bind_text(stmt, 1, typings[i].user, -1, NULL));
+			sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
+			names[count] = strdup(sqlite3_column_text(stmt, 0));
+		}
+		count++;
+	}
+	sqlite3_finalize(stmt);
+	if (count == 1) {
+		snprintf(buf, len, "%s is typing", names[0]);
+	} else if (count == 2) {
+		snprintf(buf, len, "%s and %s are typing", names[0], names[1]);
+	} else if (count > 2) {
+		snprintf(buf, len, "several people are typing");
+	}
+	for (int i=0; i<MIN(count, 2); i++) {
+		free((void*)names[i]);
+	}
+	return strlen(buf);
+}
+
+/*
+ * Messages to draw come from a k-way merge of cursors on
+ * idx_message_conversation_ts, newest first. A pane on one conversation
+ * has a single cursor, the unread timeline has one per conversation with
+ * unread messages. A heap keeps the cursors ordered by the ts of the row
+ * each is on, so a page reads about as many rows as it shows however
+ * many conversations there are, and the union is never built. A pane
+ * filtered to one user reads idx_message_conversation_user_ts instead, or
+ * idx_message_user_ts across every conversation.
+ */
+enum cursor_kind {
+	cursor_conversation,
+	cursor_conversation_user,
+	cursor_user,
+	cursor_kinds
+};
+
+#define CURSOR_SELECT \
+	"select u.name, m.user, m.text, m.acknowledged, m.id, " \
+		"(select group_concat(':' || r.name || ': ' || r.count, '  ') " \
+		"from reaction r " \
+		"where r.conversation = m.conversation " \
+		"and r.ts = m.ts), " \
+		"m.ts, " \
+		"exists(select 1 from expanded_message e where e.conversation = m.conversation and e.ts = m.ts), " \
+		"m.conversation " \
+	"from message m " \
+	"left join user u " \
+	  "on u.id = m.user "
+
+// ?1 is the conversation, ?2 the ts to read after, ?3 the anchor and ?4 the user
+static const char* cursor_sql[cursor_kinds] = {
+	[cursor_conversation] = CURSOR_SELECT
+		"where m.conversation = ?1 "
+		"and m.ts > ?2 "
+		"and (?3 is null or m.ts <= ?3) "
+		"order by m.ts desc",
+	[cursor_conversation_user] = CURSOR_SELECT
+		"where m.conversation = ?1 "
+		"and m.user = ?4 "
+		"and m.ts > ?2 "
+		"and (?3 is null or m.ts <= ?3) "
+		"order by m.ts desc",
+	[cursor_user] = CURSOR_SELECT
+		"where m.user = ?4 "
+		"and m.ts > ?2 "
+		"and (?3 is null or m.ts <= ?3) "
+		"order by m.ts desc",
+};
+
+struct merge_cursor {
+	sqlite3_stmt* stmt;
+	const char* ts;
+	enum cursor_kind kind;
+};
+
+struct message_merge {
+	struct merge_cursor* heap;
+	int len;
+	int cap;
+	// Handed out last, stepped on the next call
+	struct merge_cursor current;
+};
+
+// Cursor statements are kept for reuse, there can be thousands in a merge
+struct cursor_pool {
+	sqlite3_stmt** stmts;
+	int len;
+} idle_cursors[cursor_kinds];
+
+bool is_timeline(const char* conversation_id) {
+	return conversation_id != NULL && strcmp(conversation_id, UNREADS_CONVERSATION) == 0;
+}
+
+void open_message_merge(struct message_merge* m) {
+	m->heap = NULL;
+	m->len = 0;
+	m->cap = 0;
+	m->current.stmt = NULL;
+}
+
+void release_cursor(struct merge_cursor c) {
+	struct cursor_pool* pool = &idle_cursors[c.kind];
+	sqlite3_reset(c.stmt);
+	pool->stmts = realloc(pool->stmts, (pool->len + 1) * sizeof(sqlite3_stmt*));
+	pool->stmts[pool->len++] = c.stmt;
+}
+
+void push_merge_cursor(struct message_merge* m, struct merge_cursor cursor) {
+	if (m->len == m->cap) {
+		m->cap = MAX(m->cap * 2, 16);
+		m->heap = realloc(m->heap, m->cap * sizeof(struct merge_cursor));
+	}
+	int i = m->len++;
+	cursor.ts = sqlite3_column_text(cursor.stmt, 6);
+	m->heap[i] = cursor;
+	while (i > 0 && strcmp(m->heap[(i-1)/2].ts, m->heap[i].ts) < 0) {
+		struct merge_cursor c = m->heap[i];
+		m->heap[i] = m->heap[(i-1)/2];
+		m->heap[(i-1)/2] = c;
+		i = (i-1)/2;
+	}
+}
+
+struct merge_cursor pop_merge_cursor(struct message_merge* m) {
+	struct merge_cursor top = m->heap[0];
+	m->heap[0] = m->heap[--m->len];
+	int i = 0;
+	while (true) {
+		int newest = i;
+		for (int c = 2*i + 1; c <= 2*i + 2 && c < m->len; c++) {
+			if (strcmp(m->heap[c].ts, m->heap[newest].ts) > 0) {
+				newest = c;
+			}
+		}
+		if (newest == i) {
+			return top;
+		}
+		struct merge_cursor c = m->heap[i];
+		m->heap[i] = m->heap[newest];
+		m->heap[newest] = c;
+		i = newest;
+	}
+}
+
+/*
+ * Messages newer than after, and no newer than anchor if set, from a
+ * conversation, a user in a conversation, or a user anywhere when
+ * conversation_id is NULL.
+ */
+void add_merge_cursor(struct message_merge* m, const char* conversation_id,
+		const char* user_id, const char* after, const char* anchor) {
+	struct merge_cursor c;
+	c.kind = user_id == NULL ? cursor_conversation
+		: conversation_id == NULL ? cursor_user
+		: cursor_conversation_user;
+	struct cursor_pool* pool = &idle_cursors[c.kind];
+	if (pool->len > 0) {
+		c.stmt = pool->stmts[--pool->len];
+	} else {
+		sqlite_check(read_db, prepare_statement(read_db, cursor_sql[c.kind], -1, &c.stmt, NULL));
+	}
+	sqlite_check(read_db, sqlite3_bind_text(c.stmt, 1, conversation_id, -1, SQLITE_TRANSIENT));
+	sqlite_check(read_db, sqlite3_bind_text(c.stmt, 2, after, -1, SQLITE_TRANSIENT));
+	sqlite_check(read_db, sqlite3_bind_text(c.stmt, 3, anchor, -1, SQLITE_TRANSIENT));
+	if (c.kind != cursor_conversation) {
+		sqlite_check(read_db, sqlite3_bind_text(c.stmt, 4, user_id, -1, SQLITE_TRANSIENT));
+	}
+	int v = sqlite3_step(c.stmt);
+	if (v == SQLITE_ROW) {
+		push_merge_cursor(m, c);
+	} else {
+		if (v != SQLITE_DONE) {
+			sqlite_check(read_db, v);
+		}
+		release_cursor(c);
+	}
+}
+
+// Without a read marker, everything in a conversation is unread
+static const char* unread_cursors_sql =
+	"select /* full scan */ c.id, ifnull(rm.last_read, '') "
+	"from conversation c "
+	"left join read_marker rm "
+	  "on rm.conversation = c.id "
+	"where (c.is_member = 1 or c.is_im = 1)";
+
+// A cursor for each member conversation with messages after its read marker
+void add_unread_cursors(struct message_merge* m, const char* anchor) {
+	sqlite3_stmt* stmt;
+	sqlite_check(read_db, prepare_statement(read_db, unread_cursors_sql, -1, &stmt, NULL));
+	int v;
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		add_merge_cursor(m, sqlite3_column_text(stmt, 0), NULL, sqlite3_column_text(stmt, 1), anchor);
+	}
+	if (v != SQLITE_DONE) {
+		sqlite_check(read_db, v);
+	}
+	sqlite3_finalize(stmt);
+}
+
+// The next newest message as a statement on its row, NULL after the oldest
+sqlite3_stmt* next_merged_message(struct message_merge* m) {
+	if (m->current.stmt != NULL) {
+		int v = sqlite3_step(m->current.stmt);
+		if (v == SQLITE_ROW) {
+			push_merge_cursor(m, m->current);
+		} else {
+			if (v != SQLITE_DONE) {
+				sqlite_check(read_db, v);
+			}
+			release_cursor(m->current);
+		}
+		m->current.stmt = NULL;
+	}
+	if (m->len == 0) {
+		return NULL;
+	}
+	m->current = pop_merge_cursor(m);
+	return m->current.stmt;
+}
+
+void close_message_merge(struct message_merge* m) {
+	if (m->current.stmt != NULL) {
+		release_cursor(m->current);
+	}
+	for (int i=0; i<m->len; i++) {
+		release_cursor(m->heap[i]);
+	}
+	free(m->heap);
+	open_message_merge(m);
+}
+
+void free_idle_cursors() {
+	for (int k=0; k<cursor_kinds; k++) {
+		for (int i=0; i<idle_cursors[k].len; i++) {
+			sqlite3_finalize(idle_cursors[k].stmts[i]);
+		}
+		free(idle_cursors[k].stmts);
+		idle_cursors[k] = (struct cursor_pool){0};
+	}
+}
+
+/*
+ * The message area is split into panes stacked above each other, each
+ * showing its own conversation from its own anchor. They share the width,
+ * so they share the layout cache too. A pane's cells are kept between
+ * renders and only drawn again once something in its conversation changes,
+ * see mark_panes_dirty, so a busy pane costs the quiet ones nothing. The
+ * active pane follows the selected conversation.
+ */
+struct pane {
+	int id;
+	char* conversation;
+	// ts of the newest message shown, NULL follows new messages
+	char* anchor;
+	// Only messages from this user, see pane_filter
+	char* user;
+	bool everywhere;
+	bool active;
+	bool dirty;
+	struct frame* frame;
+	// What was on screen in frame, for the renders that reuse it
+	struct id_set visible_users;
+	sqlite3_int64 newest_collapsed;
+};
+
+struct pane panes[PANES_MAX];
+int panes_len;
+
+bool same_string(const char* a, const char* b) {
+	return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+void free_pane(struct pane* p) {
+	free(p->conversation);
+	free(p->anchor);
+	free(p->user);
+	if (p->frame != NULL) {
+		free_frame(p->frame);
+	}
+	id_set_clear(&p->visible_users);
+	*p = (struct pane){0};
+}
+
+// Redraw panes showing conversation, or all of them for NULL. The unread
+// timeline only shows what's newer than each read marker, so it's only
+// redrawn for a change that's unread.
+void mark_pane_dirty(const char* conversation, bool unread) {
+	for (int i=0; i<panes_len; i++) {
+		if (conversation == NULL || panes[i].everywhere
+				|| (unread && is_timeline(panes[i].conversation))
+				|| same_string(panes[i].conversation, conversation)) {
+			panes[i].dirty = true;
+		}
+	}
+}
+
+int get_active_pane() {
+	return get_key_value_int("active_pane", 1);
+}
+
+static const char* load_panes_sql =
+	"select /* full scan */ p.id, p.conversation, p.anchor, f.user, f.everywhere "
+	"from pane p "
+	"left join pane_filter f "
+	  "on f.pane = p.id "
+	"order by p.id "
+	"limit ?";
+
+// Reads the panes, keeping the cells of the ones that are the same as before
+void load_panes() {
+	sqlite3_stmt* stmt;
+	sqlite_check(read_db, prepare_statement(read_db, load_panes_sql, -1, &stmt, NULL));
+	sqlite_check(read_db, sqlite3_bind_int(stmt, 1, PANES_MAX));
+	int active = get_active_pane();
+	int len = 0;
+	int v;
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		struct pane* p = &panes[len++];
+		int id = sqlite3_column_int(stmt, 0);
+		const char* conversation = sqlite3_column_text(stmt, 1);
+		const char* anchor = sqlite3_column_text(stmt, 2);
+		const char* user = sqlite3_column_text(stmt, 3);
+		bool everywhere = sqlite3_column_int(stmt, 4);
+		if (p->id == id && p->active == (id == active)
+				&& same_string(p->conversation, conversation)
+				&& same_string(p->anchor, anchor)
+				&& same_string(p->user, user)
+				&& p->everywhere == everywhere) {
+			continue;
+		}
+		free_pane(p);
+		p->id = id;
+		p->conversation = conversation != NULL ? strdup(conversation) : NULL;
+		p->anchor = anchor != NULL ? strdup(anchor) : NULL;
+		p->user = user != NULL ? strdup(user) : NULL;
+		p->everywhere = everywhere;
+		p->active = id == active;
+		p->dirty = true;
+	}
+	if (v != SQLITE_DONE) {
+		sqlite_check(read_db, v);
+	}
+	sqlite3_finalize(stmt);
+	for (int i=len; i<panes_len; i++) {
+		free_pane(&panes[i]);
+	}
+	panes_len = len;
+}
+
+// Copies src into dst at x, y, clipped like tb_blit
+void blit_frame(struct frame* dst, struct frame* src, int x, int y) {
+	int w = MIN(src->width, dst->width - x);
+	for (int sy=0; sy<src->height && y+sy < dst->height; sy++) {
+		if (y+sy < 0 || w <= 0) {
+			continue;
+		}
+		memcpy(&dst->cells[(y+sy) * dst->width + x], &src->cells[sy * src->width],
+				w * sizeof(struct tb_cell));
+	}
+}
+
+static const char* conversation_name_sql =
+	"select case when c.is_im = 1 then ifnull(u.name, 'Unknown user!') else c.name end "
+	"from conversation c "
+	"left join user u "
+	  "on u.id = c.user "
+	"where c.id = ?";
+
+// Caller frees
+char* get_conversation_name(const char* conversation_id) {
+	if (is_timeline(conversation_id)) {
+		return strdup("All unreads");
+	}
+	sqlite3_stmt* stmt;
+	sqlite_check(read_db, prepare_statement(read_db, conversation_name_sql, -1, &stmt, NULL));
+	sqlite_check(read_db, sqlite3_bind_text(stmt, 1, conversation_id, -1, NULL));
+	char* name = NULL;
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW && sqlite3_column_text(stmt, 0) != NULL) {
+		name = strdup(sqlite3_column_text(stmt, 0));
+	} else if (v != SQLITE_ROW && v != SQLITE_DONE) {
+		sqlite_check(read_db, v);
+	}
+	sqlite3_finalize(stmt);
+	return name;
+}
+
+// Adds the cursors for the messages a pane shows to a merge
+void add_pane_cursors(struct message_merge* m, struct pane* p) {
+	if (is_timeline(p->conversation)) {
+		add_unread_cursors(m, p->anchor);
+	} else if (p->user != NULL) {
+		add_merge_cursor(m, p->everywhere ? NULL : p->conversation, p->user, "", p->anchor);
+	} else {
+		add_merge_cursor(m, p->conversation, NULL, "", p->anchor);
+	}
+}
+
+static const char* user_name_sql =
+	"select name from user where id = ?";
+
+// Caller frees
+char* get_user_name(const char* user_id) {
+	sqlite3_stmt* stmt;
+	sqlite_check(read_db, prepare_statement(read_db, user_name_sql, -1, &stmt, NULL));
+	sqlite_check(read_db, sqlite3_bind_text(stmt, 1, user_id, -1, NULL));
+	char* name = NULL;
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW && sqlite3_column_text(stmt, 0) != NULL) {
+		name = strdup(sqlite3_column_text(stmt, 0));
+	} else if (v != SQLITE_ROW && v != SQLITE_DONE) {
+		sqlite_check(read_db, v);
+	}
+	sqlite3_finalize(stmt);
+	return name;
+}
+
+// The conversation name, any filter, and whether it's following new messages
+void render_pane_header(struct pane* p) {
+	char* name = p->everywhere ? strdup("Every channel") : get_conversation_name(p->conversation);
+	char* user = p->user != NULL ? get_user_name(p->user) : NULL;
+	char title[200];
+	snprintf(title, 200, " %s%s%s%s", name != NULL ? name : "",
+			p->user != NULL ? ", only " : "",
+			p->user != NULL ? (user != NULL ? user : p->user) : "",
+			p->anchor != NULL ? "  (scrolled back, j for newer)" : "");
+	free(name);
+	free(user);
+	int title_len = strlen(title);
+	int fg = p->active ? CHANNELS_FG_SELECTED : STATUSLINE_FG;
+	int bg = p->active ? CHANNELS_BG_SELECTED : STATUSLINE_BG;
+	for (int i=0; i<frame->width; i++) {
+		render_char(i < title_len ? title[i] : ' ', i, 0, fg, bg);
+	}
+}
+
+// Draws the pane's messages into its own frame, newest at the bottom
+void render_pane(struct pane* p, bool header) {
+	struct frame* target = frame;
+	frame = p->frame;
+	int height = frame->height;
+	int time_start_x = 0;
+	int user_start_x = TIME_WIDTH;
+	int message_start_x = user_start_x + USER_WIDTH;
+	int message_width = frame->width - message_start_x;
+	id_set_clear(&p->visible_users);
+	p->newest_collapsed = 0;
+	if (p->conversation != NULL) {
+		struct message_merge merge;
+		open_message_merge(&merge);
+		if (!is_timeline(p->conversation) && p->user == NULL) {
+			// The visible messages are wrapped first, every one takes at least a line
+			prefetch_layouts(p->conversation, p->anchor, height, message_width);
+		}
+		add_pane_cursors(&merge, p);
+		bool more = true;
+		int msg_bg_col = MESSAGE_BG;
+		int j = height - 1;
+		// Drawn from the bottom up, so a day's label goes above its
+		// oldest message once an older day, or the start, is reached.
+		// When the pane shows more than one conversation, the
+		// conversation changing starts a group too.
+		// Layouts can be evicted by the next get_layout, so keep a copy.
+		bool grouped = is_timeline(p->conversation) || p->everywhere;
+		int newer_day = -1;
+		long newer_minute = 0;
+		char* newer_conversation = NULL;
+		while (j >= 0) {
+			if (more) {
+				sqlite3_stmt* stmt = next_merged_message(&merge);
+				struct layout* layout = NULL;
+				const char* conversation = NULL;
+				if (stmt != NULL) {
+					layout = get_layout(sqlite3_column_int64(stmt, 4),
+							sqlite3_column_text(stmt, 2),
+							sqlite3_column_text(stmt, 6),
+							sqlite3_column_int(stmt, 7),
+							message_width);
+					conversation = sqlite3_column_text(stmt, 8);
+				}
+				bool new_conversation = grouped && !same_string(conversation, newer_conversation);
+				if (newer_day != -1 && (layout == NULL || layout->day != newer_day || new_conversation)) {
+					const char* label = day_label(newer_day, newer_minute);
+					if (grouped) {
+						char* name = get_conversation_name(newer_conversation);
+						char* group = sqlite3_mprintf("%s, %s", name != NULL ? name : "", label);
+						render_day_separator(group, time_start_x, j, frame->width);
+						sqlite3_free(group);
+						free(name);
+					} else {
+						render_day_separator(label, time_start_x, j, frame->width);
+					}
+					j--;
+				}
+				newer_day = layout != NULL ? layout->day : -1;
+				newer_minute = layout != NULL ? layout->minute : 0;
+				free(newer_conversation);
+				newer_conversation = conversation != NULL ? strdup(conversation) : NULL;
+				if (stmt == NULL) {
+					more = false;
+				} else {
+					id_set_add(&p->visible_users, sqlite3_column_text(stmt, 1));
+					const char* user = sqlite3_column_text(stmt, 0);
+					if (user == NULL) {
+						user = sqlite3_column_text(stmt, 1);
+					}
+					if (user == NULL) {
+						user = "unknown!";
+					}
+					int acked = sqlite3_column_int(stmt, 3);
+					const char* reactions = sqlite3_column_text(stmt, 5);
+
+					if (layout->collapsed && p->newest_collapsed == 0) {
+						p->newest_collapsed = layout->message_id;
+					}
+
+					int more_line = layout->collapsed ? layout->lines_len : -1;
+					int reaction_start = layout->lines_len + (layout->collapsed ? 1 : 0);
+					int lines_len = reaction_start + (reactions != NULL ? 1 : 0);
+					for (int k=0; k<lines_len; k++) {
+						bool reaction_line = k == reaction_start;
+						const char* note = reaction_line ? reactions
+							: k == more_line ? COLLAPSED_NOTE
+							: NULL;
+						int line_len = note != NULL ? strlen(note) : layout->line_lens[k];
+						int y = (j-lines_len) + 1 + k;
+
+						for (int i=0; i<TIME_WIDTH; i++) {
+							char ch = k == 0 && i < TIME_WIDTH-1 ? layout->time[i] : ' ';
+							render_char(ch, i+time_start_x, y, TIME_FG, msg_bg_col);
+						}
+
+						const char* usrstr = k == 0 ? user : "";
+						int usrstrlen = strlen(usrstr);
+						// Add 1 padding for readability here.
+						for (int i=1; i<USER_WIDTH; i++) {
+							char ch = (i-1) < usrstrlen ? usrstr[i-1] : ' ';
+							int x = i + user_start_x;
+							render_char(ch, i+user_start_x, y, USER_FG, msg_bg_col);
+						}
+
+						int fg = note != NULL ? REACTION_FG
+							: acked > 0 ? MESSAGE_FG
+							: acked < 0 ? MESSAGE_FG_FAILED
+							: MESSAGE_FG_UNACKED;
+						for (int i=0; i<message_width; i++) {
+							u_int32_t ch;
+							if (i >= line_len) {
+								ch = ' ';
+							} else if (note != NULL) {
+								ch = note[i];
+							} else {
+								ch = layout->lines[k][i];
+							}
+							int x = i + message_start_x;
+							render_char(ch, x, y, fg, msg_bg_col);
+						}
+					}
+					j -= lines_len;
+					// toggle the background colour between messages
+					msg_bg_col = msg_bg_col == MESSAGE_BG ? MESSAGE_BG_ALT : MESSAGE_BG;
+				}
+			} else {
+				for (int i=0; i<TIME_WIDTH + USER_WIDTH; i++) {
+					render_char(' ', i+time_start_x, j, USER_FG, USER_BG);
+				}
+				for (int i=0; i<message_width; i++) {
+					render_char(' ', i+message_start_x, j, MESSAGE_FG, MESSAGE_BG);
+				}
+				j--;
+			}
+		}
+		close_message_merge(&merge);
+		free(newer_conversation);
+	}
+	if (header && height > 0) {
+		render_pane_header(p);
+	}
+	frame = target;
+}
+
+static const char* conversation_list_page_sql =
+	"select cl.id, cl.display_name, c.user, "
+		"(select count(1) "
+		"from message m "
+		"where m.conversation = cl.id "
+		"and m.ts > ifnull(rm.last_read, '')) "
+	"from conversation_list cl "
+	"left join conversation c "
+	  "on c.id = cl.id "
+	"left join read_marker rm "
+	  "on rm.conversation = cl.id "
+	"order by cl.display_name "
+	"limit ? "
+	"offset ? ";
+
+void render() {
+	int width = screen_width;
+	int height = screen_height;
+	frame = new_frame(width, height);
+	
+	int bottom_pos = 1;
+
+	// Write the input buffer
+	int mode = get_current_mode();
+	struct input_buffer* b = mode == mode_search ? &search_input_buffer
+		: mode == mode_goto ? &goto_input_buffer
+		: mode == mode_filter ? &filter_input_buffer
+		: mode == mode_export ? &export_input_buffer
+		: &message_input_buffer;
+	load_input_buffer(b);
+	int cursor_pos = get_input_cursor_pos(b);
+	int input_len = input_buffer_len(b);
+	for (int i=0; i<MIN(width, input_len); i++) {
+		render_char(input_buffer_char_at(b, i), i, height-bottom_pos,
+				TEXTBOX_FG, TEXTBOX_BG);
+	}
+	frame->cursor_x = cursor_pos;
+	frame->cursor_y = height-bottom_pos;
+	bottom_pos++;
+
+	const char* selected_conversation_id = get_selected_conversation();
+
+	// Write the status line	
+	char status[200];
+	int mdl = snprintf(status, 200, "%s  ", mode_desc());
+	mdl += typing_desc(selected_conversation_id, &status[mdl], 200 - mdl);
+	const char* status_keys[] = {"send_status", "export_status"};
+	for (int i=0; i<2; i++) {
+		char* s = get_key_value_string(status_keys[i], NULL);
+		if (s != NULL) {
+			mdl += snprintf(&status[mdl], 200 - mdl, "  %s", s);
+			mdl = MIN(mdl, 199);
+			free(s);
+		}
+	}
+	for (int i=0; i<MIN(width, mdl); i++) {
+		render_char(status[i], i, height-bottom_pos,
+				STATUSLINE_FG, STATUSLINE_BG);
+	}
+	bottom_pos++;
+
+	// Recalculate the display for channels list
+	int max_chans = height - (bottom_pos-1);
+	int conversation_selection_pos = get_conversation_selection_pos();
+	int conversation_window_start = get_conversation_window_start();
+	if ((conversation_selection_pos - conversation_window_start) >= max_chans) {
+		set_conversation_window_start(conversation_selection_pos - (max_chans-1));
+	} else if (conversation_selection_pos < conversation_window_start) {
+		set_conversation_window_start(conversation_selection_pos);
+	}
+
+	struct id_set visible_users = {0};
+	sqlite3_stmt* stmt;
+	sqlite_check(read_db, sqlite3_exec(read_db, "begin", NULL, NULL, NULL));
+	sqlite_check(read_db, prepare_statement(read_db, conversation_list_page_sql, -1, &stmt, NULL));
+	sqlite_check(read_db, sqlite3_bind_int(stmt, 1, max_chans));
+	sqlite_check(read_db, sqlite3_bind_int(stmt, 2, conversation_window_start))
+
+	bool more = true;
+	for (int j=0; j<max_chans; j++) {
+		const char* id = "";
+		const char* name = "";
+		const char* im_user = NULL;
+		int unread = 0;
+		if (more) {
+			int v = sqlite3_step(stmt);
+			if (v == SQLITE_DONE) {
+				more = false;
+			} else if (v == SQLITE_ROW) {
+				id = sqlite3_column_text(stmt, 0);
+				name = sqlite3_column_text(stmt, 1);
+				im_user = sqlite3_column_text(stmt, 2);
+				unread = sqlite3_column_int(stmt, 3);
+			} else {
+				sqlite_check(read_db, v);
+			}
+		} 
+		bool selected = selected_conversation_id != NULL && strcmp(id, selected_conversation_id) == 0;
+		int namelen = strlen(name);
+		int fg = selected ? CHANNELS_FG_SELECTED : CHANNELS_FG;
+		int bg = selected ? CHANNELS_BG_SELECTED : CHANNELS_BG;
+		char count[16] = "";
+		if (unread > 0) {
+			fg |= TB_BOLD;
+			snprintf(count, 16, " %d ", unread);
+		}
+		int count_start = CHANS_WIDTH - 1 - strlen(count);
+		for (int i=0; i<CHANS_WIDTH; i++) {
+			char ch = i<namelen ? name[i] : ' ';
+			if (i >= count_start && i < CHANS_WIDTH - 1) {
+				ch = count[i - count_start];
+			}
+			render_char(ch, i, j, fg, bg);
+		}
+		// Presence of the other person in direct messages
+		if (im_user != NULL) {
+			id_set_add(&visible_users, im_user);
+			if (is_user_active(im_user)) {
+				render_char(0x25CF, CHANS_WIDTH-1, j, PRESENCE_ACTIVE_FG, bg);
+			}
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	// Write the message panes, only the ones that changed are drawn again
+	int max_messages = height - (bottom_pos-1);
+	int pane_width = width - CHANS_WIDTH;
+	int message_width = pane_width - TIME_WIDTH - USER_WIDTH;
+	if (message_width != layout_width) {
+		layout_width = message_width;
+		mg_timer_free(&relayout_timer);
+		mg_timer_init(&relayout_timer, RELAYOUT_SETTLE_MS, 0, relayout_cache, NULL);
+	}
+	load_panes();
+	newest_collapsed_visible = 0;
+	int pane_y = 0;
+	for (int i=0; i<panes_len; i++) {
+		struct pane* p = &panes[i];
+		int pane_height = max_messages / panes_len + (i < max_messages % panes_len ? 1 : 0);
+		if (p->frame == NULL || p->frame->width != pane_width || p->frame->height != pane_height) {
+			if (p->frame != NULL) {
+				free_frame(p->frame);
+			}
+			p->frame = new_frame(pane_width, pane_height);
+			p->dirty = true;
+		}
+		if (p->dirty) {
+			render_pane(p, panes_len > 1 || p->anchor != NULL
+					|| is_timeline(p->conversation) || p->user != NULL);
+			p->dirty = false;
+		}
+		blit_frame(frame, p->frame, CHANS_WIDTH, pane_y);
+		pane_y += pane_height;
+		for (int k=0; k<p->visible_users.len; k++) {
+			id_set_add(&visible_users, p->visible_users.ids[k]);
+		}
+		if (p->active) {
+			newest_collapsed_visible = p->newest_collapsed;
+		}
+	}
+	sqlite_check(read_db, sqlite3_exec(read_db, "commit", NULL, NULL, NULL));
+	free((void*)selected_conversation_id);
+	set_visible_users(&visible_users);
+
+	present_frame(frame);
+	frame = NULL;
+}
+
+static const char* expand_message_sql =
+	"insert or ignore into expanded_message (conversation, ts) "
+	"select conversation, ts from message where id = ?";
+
+void expand_message(sqlite3_int64 message_id) {
+	if (message_id == 0) {
+		return;
+	}
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, expand_message_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_int64(stmt, 1, message_id));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+}
+
+static const char* collapse_messages_sql =
+	"delete from expanded_message "
+	"where conversation = (select value from kvs where key = 'selected_conversation')";
+
+// Collapses everything expanded in the selected conversation again
+void collapse_messages() {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, collapse_messages_sql, -1, &stmt, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+}
+
+static const char* pane_conversation_sql =
+	"select conversation from pane where id = ?";
+
+// Caller frees
+char* get_pane_conversation(int id) {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, pane_conversation_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, id));
+	char* res = NULL;
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW && sqlite3_column_text(stmt, 0) != NULL) {
+		res = strdup(sqlite3_column_text(stmt, 0));
+	} else if (v != SQLITE_ROW && v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	sqlite3_finalize(stmt);
+	return res;
+}
+
+// Makes a pane active, selecting its conversation
+void activate_pane(int id) {
+	set_key_value_int("active_pane", id);
+	char* conversation_id = get_pane_conversation(id);
+	if (conversation_id != NULL && !is_timeline(conversation_id)) {
+		set_selected_conversation(conversation_id);
+	}
+	free(conversation_id);
+}
+
+static const char* toggle_unreads_sql =
+	"update pane "
+	"set conversation = case when conversation = ?1 "
+	  "then (select value from kvs where key = 'selected_conversation') "
+	  "else ?1 end, "
+	"anchor = null "
+	"where id = ?2";
+
+// Shows the unread timeline in the current pane, or goes back to the selected conversation
+void toggle_unreads() {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, toggle_unreads_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, UNREADS_CONVERSATION, -1, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 2, get_active_pane()));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+}
+
+static const char* next_unread_sql =
+	"select /* full scan */ min(("
+		"select m.ts "
+		"from message m "
+		"where m.conversation = c.id "
+		"and m.ts > max(ifnull(rm.last_read, ''), ?) "
+		"order by m.ts "
+		"limit 1)) "
+	"from conversation c "
+	"left join read_marker rm "
+	  "on rm.conversation = c.id "
+	"where (c.is_member = 1 or c.is_im = 1)";
+
+// The oldest unread message newer than ts in any conversation, one seek each. Caller frees
+char* next_unread_after(const char* ts) {
+	sqlite3_stmt* stmt;
+	sqlite_check(read_db, prepare_statement(read_db, next_unread_sql, -1, &stmt, NULL));
+	sqlite_check(read_db, sqlite3_bind_text(stmt, 1, ts, -1, NULL));
+	sqlite_check_ex(read_db, sqlite3_step(stmt), SQLITE_ROW);
+	const char* next = sqlite3_column_text(stmt, 0);
+	char* res = next != NULL ? strdup(next) : NULL;
+	sqlite3_finalize(stmt);
+	return res;
+}
+
+static const char* next_user_message_everywhere_sql =
+	"select ts from message "
+	"where user = ?2 "
+	"and ts > ?3 "
+	"order by ts "
+	"limit 1";
+static const char* next_user_message_sql =
+	"select ts from message "
+	"where conversation = ?1 "
+	"and user = ?2 "
+	"and ts > ?3 "
+	"order by ts "
+	"limit 1";
+
+// The oldest message from the filtered user newer than ts. Caller frees
+char* next_user_message_after(struct pane* p, const char* ts) {
+	sqlite3_stmt* stmt;
+	sqlite_check(read_db, prepare_statement(read_db, p->everywhere
+				? next_user_message_everywhere_sql
+				: next_user_message_sql, -1, &stmt, NULL));
+	if (!p->everywhere) {
+		sqlite_check(read_db, sqlite3_bind_text(stmt, 1, p->conversation, -1, NULL));
+	}
+	sqlite_check(read_db, sqlite3_bind_text(stmt, 2, p->user, -1, NULL));
+	sqlite_check(read_db, sqlite3_bind_text(stmt, 3, ts, -1, NULL));
+	char* res = NULL;
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		res = strdup(sqlite3_column_text(stmt, 0));
+	} else if (v != SQLITE_DONE) {
+		sqlite_check(read_db, v);
+	}
+	sqlite3_finalize(stmt);
+	return res;
+}
+
+char* next_pane_message_after(struct pane* p, const char* ts) {
+	return is_timeline(p->conversation) ? next_unread_after(ts) : next_user_message_after(p, ts);
+}
+
+/*
+ * The anchor of a pane reading a merge, the timeline or a filter, moves
+ * along the merge. Older is the second message from the anchor, newer
+ * than the newest follows again.
+ */
+char* scroll_merged_pane(struct pane* p, bool older) {
+	const char* anchor = p->anchor;
+	if (!older) {
+		char* next = anchor != NULL ? next_pane_message_after(p, anchor) : NULL;
+		char* after_next = next != NULL ? next_pane_message_after(p, next) : NULL;
+		if (after_next == NULL) {
+			free(next);
+			return NULL;
+		}
+		free(after_next);
+		return next;
+	}
+	struct message_merge merge;
+	open_message_merge(&merge);
+	add_pane_cursors(&merge, p);
+	sqlite3_stmt* stmt = next_merged_message(&merge);
+	if (stmt != NULL) {
+		stmt = next_merged_message(&merge);
+	}
+	char* res = NULL;
+	if (stmt != NULL) {
+		res = strdup(sqlite3_column_text(stmt, 6));
+	} else if (anchor != NULL) {
+		// Already at the oldest
+		res = strdup(anchor);
+	}
+	close_message_merge(&merge);
+	return res;
+}
+
+static const char* read_pane_sql =
+	"select p.conversation, p.anchor, f.user, f.everywhere "
+	"from pane p "
+	"left join pane_filter f "
+	  "on f.pane = p.id "
+	"where p.id = ?";
+
+// Reads what a pane shows, without any of its drawing
+void read_pane(int id, struct pane* p) {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, read_pane_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, id));
+	*p = (struct pane){.id = id};
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		const char* conversation = sqlite3_column_text(stmt, 0);
+		const char* anchor = sqlite3_column_text(stmt, 1);
+		const char* user = sqlite3_column_text(stmt, 2);
+		p->conversation = conversation != NULL ? strdup(conversation) : NULL;
+		p->anchor = anchor != NULL ? strdup(anchor) : NULL;
+		p->user = user != NULL ? strdup(user) : NULL;
+		p->everywhere = sqlite3_column_int(stmt, 3);
+	} else if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	sqlite3_finalize(stmt);
+}
+
+static const char* set_pane_anchor_sql =
+	"update pane set anchor = ? where id = ?";
+
+void scroll_active_merged_pane(struct pane* p, bool older) {
+	sqlite_check(read_db, sqlite3_exec(read_db, "begin", NULL, NULL, NULL));
+	char* new_anchor = scroll_merged_pane(p, older);
+	sqlite_check(read_db, sqlite3_exec(read_db, "commit", NULL, NULL, NULL));
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, set_pane_anchor_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, new_anchor, -1, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 2, get_active_pane()));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+	free(new_anchor);
+}
+
+static const char* split_pane_sql =
+	"insert into pane (conversation) "
+	"select value from kvs where key = 'selected_conversation'";
+
+// Opens another pane on the selected conversation, below the others
+void split_pane() {
+	if (panes_len >= PANES_MAX) {
+		return;
+	}
+	sqlite_check(db, exec_statement(db, split_pane_sql));
+	if (sqlite3_changes(db) > 0) {
+		activate_pane(sqlite3_last_insert_rowid(db));
+	}
+}
+
+// Pane ids are picked with sql like next_pane_sql
+void activate_pane_by(const char* sql, int active) {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, active));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
+	int id = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	activate_pane(id);
+}
+
+static const char* delete_pane_sql =
+	"delete from pane where id = ?";
+static const char* clear_pane_filter_sql =
+	"delete from pane_filter where pane = ?";
+static const char* previous_pane_sql =
+	"select ifnull((select max(id) from pane where id < ?1), "
+	"(select min(id) from pane))";
+static const char* next_pane_sql =
+	"select ifnull((select min(id) from pane where id > ?1), "
+	"(select min(id) from pane))";
+
+void close_pane() {
+	if (panes_len <= 1) {
+		return;
+	}
+	int active = get_active_pane();
+	// Pane ids are reused, a new pane mustn't pick up this one's filter
+	const char* statements[] = {delete_pane_sql, clear_pane_filter_sql};
+	for (int i=0; i<2; i++) {
+		sqlite3_stmt* stmt;
+		sqlite_check(db, prepare_statement(db, statements[i], -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_int(stmt, 1, active));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+	}
+	activate_pane_by(previous_pane_sql, active);
+}
+
+void next_pane() {
+	activate_pane_by(next_pane_sql, get_active_pane());
+}
+
+static const char* scroll_older_sql =
+	"select m.ts, 0 "
+	"from pane p "
+	"join message m "
+	  "on m.conversation = p.conversation "
+	"where p.id = ? "
+	"and m.ts < ifnull(p.anchor, "
+	  "(select max(ts) from message where conversation = p.conversation)) "
+	"order by m.ts desc "
+	"limit 1";
+static const char* scroll_newer_sql =
+	"select m.ts, "
+	  "m.ts = (select max(ts) from message where conversation = p.conversation) "
+	"from pane p "
+	"join message m "
+	  "on m.conversation = p.conversation "
+	"where p.id = ? "
+	"and m.ts > p.anchor "
+	"order by m.ts "
+	"limit 1";
+
+/*
+ * Moves the active pane's anchor to the next older or newer message.
+ * Moving newer than the newest message follows new messages again.
+ */
+void scroll_pane(bool older) {
+	struct pane p;
+	read_pane(get_active_pane(), &p);
+	bool merged = is_timeline(p.conversation) || p.user != NULL;
+	if (merged) {
+		scroll_active_merged_pane(&p, older);
+	}
+	free_pane(&p);
+	if (merged) {
+		return;
+	}
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, older ? scroll_older_sql : scroll_newer_sql, 
+				-1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, get_active_pane()));
+	int v = sqlite3_step(stmt);
+	if (v != SQLITE_ROW && v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	if (v == SQLITE_DONE && older) {
+		// Already at the oldest message
+		sqlite3_finalize(stmt);
+		return;
+	}
+	char* anchor = NULL;
+	if (v == SQLITE_ROW && !sqlite3_column_int(stmt, 1)) {
+		anchor = strdup(sqlite3_column_text(stmt, 0));
+	}
+	sqlite3_finalize(stmt);
+	sqlite_check(db, prepare_statement(db, set_pane_anchor_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, anchor, -1, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 2, get_active_pane()));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+	free(anchor);
+}
+
+void handle_event_mode_normal(struct tb_event* evt) {
+	switch (evt->ch) {
+	case 'i':
+		set_current_mode(mode_insert);
+		return;
+	case '/': 
+		set_current_mode(mode_search);
+		return;
+	case 'g':
+		set_current_mode(mode_goto);
+		return;
+	case 'f':
+		set_key_value_int("filter_everywhere", 0);
+		set_current_mode(mode_filter);
+		return;
+	case 'F':
+		set_key_value_int("filter_everywhere", 1);
+		set_current_mode(mode_filter);
+		return;
+	case 'o':
+		set_current_mode(mode_export);
+		return;
+	case 'w': 
+		select_previous_conversation();
+		return;
+	case 's':
+		select_next_conversation();
+		return;
+	case 'e':
+		expand_message(newest_collapsed_visible);
+		return;
+	case 'E':
+		collapse_messages();
+		return;
+	case 'p':
+		split_pane();
+		return;
+	case 'x':
+		close_pane();
+		return;
+	case 'n':
+		next_pane();
+		return;
+	case 'u':
+		toggle_unreads();
+		return;
+	case 'k':
+		scroll_pane(true);
+		return;
+	case 'j':
+		scroll_pane(false);
+		return;
+	case 'q': 
+		quit = true;
+		return;
+	default:
+		return;
+	}
+}
+
+static const char* unsent_messages_sql =
+	"select m.id, json_object("
+		"'id', m.id, "
+		"'channel', m.conversation, "
+		"'type', 'message', "
+		"'text', m.text "
+	") from message m "
+	"left join outbox o "
+	  "on o.message_id = m.id "
+	"left join message prev "
+	  "on prev.id = o.after "
+	"where m.pending = 1 "
+	"and (prev.id is null or prev.acknowledged = 1)";
+
+static const char* mark_message_sent_sql =
+	"update message set pending = 0 where id = ?";
+
+/*
+ * Sends messages waiting in the outbox. A message split into chunks only
+ * sends each chunk once the previous one is acknowledged, see the outbox
+ * table, so the chunks arrive in order.
+ */
+void send_pending_messages(struct state_update* u) {
+	if (ws_connection == NULL) {
+		return;
+	}
+	if (strcmp(u->tablename, "message") != 0) {
+		return;
+	}
+	if (u->operation == SQLITE_DELETE) {
+		return;
+	}
+	struct state_update* next = peek_state_update();
+	if (next != NULL && strcmp(next->tablename, "message") == 0) {
+		return;
+	}
+	// Find unsent messages
+	sqlite3_stmt* stmt;
+	sqlite3_stmt* sent_stmt;
+	sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
+	sqlite_check(db, prepare_statement(db, unsent_messages_sql, -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, mark_message_sent_sql, -1, &sent_stmt, NULL));
+	int v;
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		const char* payload = sqlite3_column_text(stmt, 1);
+		dbg("sending message %s", payload);
+		mg_ws_send(ws_connection, payload, strlen(payload), WEBSOCKET_OP_TEXT);
+		sqlite_check(db, sqlite3_bind_int64(sent_stmt, 1, sqlite3_column_int64(stmt, 0)));
+		sqlite_check_ex(db, sqlite3_step(sent_stmt), SQLITE_DONE);
+		sqlite3_reset(sent_stmt);
+	}
+	if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(sent_stmt);
+	sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
+}
+
+/*
+ * Length of the next chunk of a message starting at start, no longer than
+ * MESSAGE_CHUNK_MAX. Prefers breaking between paragraphs, then lines,
+ * then words. *skip is set to the length of the break to drop.
+ */
+int next_chunk_len(struct input_buffer* b, int start, int* skip) {
+	int len = input_buffer_len(b) - start;
+	*skip = 0;
+	if (len <= MESSAGE_CHUNK_MAX) {
+		return len;
+	}
+	int paragraph = -1;
+	int line = -1;
+	int word = -1;
+	for (int i=MESSAGE_CHUNK_MAX; i>0 && paragraph < 0; i--) {
+		u_int32_t ch = input_buffer_char_at(b, start+i);
+		if (ch == '\n' && input_buffer_char_at(b, start+i-1) == '\n') {
+			paragraph = i-1;
+		} else if (ch == '\n' && line < 0) {
+			line = i;
+		} else if (ch == ' ' && word < 0) {
+			word = i;
+		}
+	}
+	if (paragraph > 0) {
+		*skip = 2;
+		return paragraph;
+	} else if (line > 0) {
+		*skip = 1;
+		return line;
+	} else if (word > 0) {
+		*skip = 1;
+		return word;
+	}
+	return MESSAGE_CHUNK_MAX;
+}
+
+static const char* insert_message_sql =
+	"insert into message (conversation, type, user, text, ts, pending, acknowledged) "
+	"values (?, ?, ?, ?, ?, ?, ?)";
+
+static const char* insert_outbox_sql =
+	"insert into outbox (message_id, after) "
+	"values (?, ?)";
+
+/*
+ * Queues the message in the outbox, split into chunks if it's longer
+ * than slack allows.
+ */
+bool send_message(struct input_buffer* b) {
+	char* current_user_id = get_current_user_id();
+	if (ws_connection == NULL 
+	  || current_user_id == NULL
+	  || input_buffer_len(b) == 0) {
+		free(current_user_id);
+		return false;
+	}
+	const char* selected_conversation_id = get_selected_conversation();
+	sqlite3_stmt* stmt;
+	sqlite3_stmt* outbox_stmt;
+	sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
+	sqlite_check(db, prepare_statement(db, insert_message_sql, -1, &stmt, NULL));
+	sqlite_check(db, prepare_statement(db, insert_outbox_sql, -1, &outbox_stmt, NULL));
+	sqlite3_int64 previous_id = -1;
+	time_t t = time(NULL);
+	int skip;
+	for (int start=0, n=0; start < input_buffer_len(b); start += skip, n++) {
+		int len = next_chunk_len(b, start, &skip);
+		char* text = malloc(len * 6 + 1);
+		int j = 0;
+		for (int i=start; i<start+len; i++) {
+			j += tb_utf8_unicode_to_char(&text[j], input_buffer_char_at(b, i));
+		}
+		text[j] = '\0';
+		start += len;
+
+		// Keep chunks in order until slack gives them a real ts
+		char ts[24];
+		snprintf(ts, 24, "%ld.%06d", t, n);
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, selected_conversation_id, -1, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 2, "message", -1, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 3, current_user_id, -1, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 4, text, -1, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 5, ts, -1, NULL));
+		sqlite_check(db, sqlite3_bind_int(stmt, 6, 1));
+		sqlite_check(db, sqlite3_bind_int(stmt, 7, 0));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_reset(stmt);
+		free(text);
+
+		sqlite3_int64 id = sqlite3_last_insert_rowid(db);
+		if (previous_id >= 0) {
+			sqlite_check(db, sqlite3_bind_int64(outbox_stmt, 1, id));
+			sqlite_check(db, sqlite3_bind_int64(outbox_stmt, 2, previous_id));
+			sqlite_check_ex(db, sqlite3_step(outbox_stmt), SQLITE_DONE);
+			sqlite3_reset(outbox_stmt);
+		}
+		previous_id = id;
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(outbox_stmt);
+	sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
+	set_key_value_string("send_status", NULL);
+
+	free((void*)selected_conversation_id);
+	free(current_user_id);
+
+	return true;
+}
+
+/*
+ * Complete the @user or #channel before the cursor. Pressing tab again
+ * replaces the completion with the next match.
+ */
+void complete_mention(struct input_buffer* b) {
+	if (!completion.active) {
+		int start = prev_word_pos(b);
+		int cursor_pos = get_input_cursor_pos(b);
+		if (start == cursor_pos) {
+			return;
+		}
+		u_int32_t sigil = input_buffer_char_at(b, start);
+		struct completion_index* idx = sigil == '@' ? &user_completions
+			: sigil == '#' ? &channel_completions
+			: NULL;
+		if (idx == NULL) {
+			return;
+		}
+		if (idx->stale) {
+			completion_index_rebuild(idx);
+		}
+		char* prefix = malloc((cursor_pos - start) * 6 + 1);
+		int j = 0;
+		for (int i=start+1; i<cursor_pos; i++) {
+			j += tb_utf8_unicode_to_char(&prefix[j], input_buffer_char_at(b, i));
+		}
+		prefix[j] = '\0';
+		int index = completion_index_lower_bound(idx, prefix);
+		if (!completion_matches(idx, index, prefix)) {
+			free(prefix);
+			return;
+		}
+		completion.active = true;
+		completion.idx = idx;
+		completion.prefix = prefix;
+		completion.start = start + 1;
+		completion.len = cursor_pos - completion.start;
+		completion.index = index;
+	} else {
+		completion.index++;
+		if (!completion_matches(completion.idx, completion.index, completion.prefix)) {
+			completion.index = completion_index_lower_bound(completion.idx, completion.prefix);
+			if (!completion_matches(completion.idx, completion.index, completion.prefix)) {
+				return;
+			}
+		}
+	}
+	const char* name = completion.idx->entries[completion.index].name;
+	b->edit_sealed = true;
+	delete_input_buffer(completion.start, completion.len, b);
+	b->edit_sealed = true;
+	int len = 0;
+	for (int i=0; name[i] != '\0'; len++) {
+		u_int32_t u;
+		i += tb_utf8_char_to_unicode(&u, &name[i]);
+		insert_input_buffer(u, b);
+	}
+	completion.len = len;
+}
+
+void end_completion() {
+	if (completion.active) {
+		free(completion.prefix);
+		completion.active = false;
+	}
+}
+
+void update_input_buffer(struct tb_event* evt, 
+		struct input_buffer* b,
+		void (*enter_callback)(struct input_buffer* b)) {
+	load_input_buffer(b);
+	if (evt->key != TB_KEY_TAB) {
+		end_completion();
+	}
+	int input_cursor_pos = get_input_cursor_pos(b);
+	if (evt->key == TB_KEY_TAB) {
+		complete_mention(b);
+	} else if (evt->key == TB_KEY_ARROW_LEFT) {
+		set_input_cursor_pos(input_cursor_pos-1, b);
+	} else if (evt->key == TB_KEY_ARROW_RIGHT) {
+		set_input_cursor_pos(input_cursor_pos+1, b);
+	} else if (evt->key == TB_KEY_HOME) {
+		set_input_cursor_pos(0, b);
+	} else if (evt->key == TB_KEY_END) {
+		set_input_cursor_pos(input_buffer_len(b), b);
+	} else if (evt->key == TB_KEY_CTRL_B) {
+		set_input_cursor_pos(prev_word_pos(b), b);
+	} else if (evt->key == TB_KEY_CTRL_F) {
+		set_input_cursor_pos(next_word_pos(b), b);
+	} else if (evt->key == TB_KEY_CTRL_W) {
+		// A word deletion is undone on its own
+		int start = prev_word_pos(b);
+		b->edit_sealed = true;
+		delete_input_buffer(start, input_cursor_pos - start, b);
+		b->edit_sealed = true;
+	} else if (evt->key == TB_KEY_CTRL_Z) {
+		undo_input_buffer(b);
+	} else if (evt->key == TB_KEY_BACKSPACE 
+	        || evt->key == TB_KEY_BACKSPACE2) {
+		delete_input_buffer(input_cursor_pos-1, 1, b);
+	} else if (evt->key == TB_KEY_DELETE) {
+		delete_input_buffer(input_cursor_pos, 1, b);
+	} else if (evt->key == TB_KEY_ENTER) {
+		enter_callback(b);
+	} else if (evt->key == TB_KEY_SPACE) {
+		insert_input_buffer(' ', b);
+	} else if (evt->ch != 0) {
+		insert_input_buffer(evt->ch, b);
+	}
+	if (b == &search_input_buffer) {
+		persist_input_buffer(b);
+	}
+	schedule_persist_input_buffers();
+	request_render();
+}
+
+void send_and_clear(struct input_buffer* b) {
+	if (send_message(b)) {
+		clear_input_buffer(b);
+	}
+}
+
+void finish_search(struct input_buffer* b) {
+	set_current_mode(mode_normal);
+}
+
+/*
+ * Reads "yyyy-mm-dd", "yyyy-mm-dd hh:mm" or "hh:mm" for today, in local
+ * time, into a slack ts.
+ */
+bool parse_goto_time(const char* text, char* ts, int len) {
+	time_t now = time(NULL);
+	struct tm tm = *localtime(&now);
+	int year, month, day, hour = 0, minute = 0;
+	char rest;
+	int n = sscanf(text, "%d-%d-%d %d:%d %c", &year, &month, &day, &hour, &minute, &rest);
+	if (n == 3 || n == 5) {
+		tm.tm_year = year - 1900;
+		tm.tm_mon = month - 1;
+		tm.tm_mday = day;
+	} else if (sscanf(text, "%d:%d %c", &hour, &minute, &rest) != 2) {
+		return false;
+	}
+	tm.tm_hour = hour;
+	tm.tm_min = minute;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	time_t t = mktime(&tm);
+	if (t == -1) {
+		return false;
+	}
+	snprintf(ts, len, "%ld.000000", (long)t);
+	return true;
+}
+
+void seek_pane(int pane_id, const char* conversation_id, const char* ts, bool fetch);
+
+// Stays in go to mode until the time makes sense
+void finish_goto(struct input_buffer* b) {
+	char* text = input_buffer_to_utf8(b);
+	char ts[32];
+	bool valid = parse_goto_time(text, ts, 32);
+	free(text);
+	if (!valid) {
+		return;
+	}
+	set_current_mode(mode_normal);
+	int active = get_active_pane();
+	char* conversation_id = get_pane_conversation(active);
+	if (conversation_id != NULL && !is_timeline(conversation_id)) {
+		seek_pane(active, conversation_id, ts, true);
+	}
+	free(conversation_id);
+}
+
+static const char* set_pane_filter_sql =
+	"insert or replace into pane_filter (pane, user, everywhere) "
+	"select ?, id, ? from user where name = ? limit 1";
+
+static const char* reset_pane_anchor_sql =
+	"update pane set anchor = null where id = ?";
+
+/*
+ * Restricts the current pane to what one user said, in its conversation
+ * or everywhere. The name can be completed with tab like an @mention.
+ * Nothing entered shows everyone again.
+ */
+void finish_filter(struct input_buffer* b) {
+	char* text = input_buffer_to_utf8(b);
+	char* name = text[0] == '@' ? text + 1 : text;
+	int len = strlen(name);
+	while (len > 0 && name[len-1] == ' ') {
+		name[--len] = '\0';
+	}
+	int active = get_active_pane();
+	sqlite3_stmt* stmt;
+	if (len == 0) {
+		sqlite_check(db, prepare_statement(db, clear_pane_filter_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_int(stmt, 1, active));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+		set_current_mode(mode_normal);
+		free(text);
+		return;
+	}
+	sqlite_check(db, prepare_statement(db, set_pane_filter_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, active));
+	sqlite_check(db, sqlite3_bind_int(stmt, 2, get_key_value_int("filter_everywhere", 0)));
+	sqlite_check(db, sqlite3_bind_text(stmt, 3, name, -1, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+	free(text);
+	// Stays in filter mode until the name is one we know
+	if (sqlite3_changes(db) == 0) {
+		return;
+	}
+	sqlite_check(db, prepare_statement(db, reset_pane_anchor_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, active));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+	set_current_mode(mode_normal);
+}
+
+struct export;
+struct export* new_export(const char* conversation_id, const char* path,
+		const char* since, const char* until);
+void start_export(struct export* e);
+
+// A "yyyy-mm-dd" with nothing after it
+bool is_goto_day(const char* text) {
+	int year, month, day;
+	char rest;
+	return sscanf(text, "%d-%d-%d %c", &year, &month, &day, &rest) == 3;
+}
+
+/*
+ * Exports the current pane's conversation to a file, optionally from one
+ * day up to another. Only whole days, since the words are split on
+ * spaces, and not to stdout, which is the terminal. Stays in export mode
+ * until the input makes sense.
+ */
+void finish_export(struct input_buffer* b) {
+	char* text = input_buffer_to_utf8(b);
+	char path[256], since[32], until[32];
+	char rest;
+	int n = sscanf(text, "%255s %31s %31s %c", path, since, until, &rest);
+	free(text);
+	if (n < 1 || n > 3 || strcmp(path, "-") == 0) {
+		return;
+	}
+	if ((n >= 2 && !is_goto_day(since)) || (n >= 3 && !is_goto_day(until))) {
+		return;
+	}
+	char* conversation_id = get_pane_conversation(get_active_pane());
+	if (conversation_id == NULL || is_timeline(conversation_id)) {
+		free(conversation_id);
+		return;
+	}
+	struct export* e = new_export(conversation_id, path,
+			n >= 2 ? since : NULL, n >= 3 ? until : NULL);
+	free(conversation_id);
+	if (e == NULL) {
+		return;
+	}
+	set_current_mode(mode_normal);
+	start_export(e);
+}
+
+void handle_event_insert(struct tb_event* evt) {
+	update_input_buffer(evt, &message_input_buffer, send_and_clear);
+}
+
+void handle_event_search(struct tb_event* evt) {
+	update_input_buffer(evt, &search_input_buffer, finish_search);
+}
+
+void handle_event_goto(struct tb_event* evt) {
+	update_input_buffer(evt, &goto_input_buffer, finish_goto);
+}
+
+void handle_event_filter(struct tb_event* evt) {
+	update_input_buffer(evt, &filter_input_buffer, finish_filter);
+}
+
+void handle_event_export(struct tb_event* evt) {
+	update_input_buffer(evt, &export_input_buffer, finish_export);
+}
+
+void read_selected_conversation();
+
+void handle_event(struct tb_event* evt) {
+	if (evt->type == TB_EVENT_FOCUS) {
+		focused = evt->key == TB_KEY_FOCUS_IN;
+		if (focused) {
+			// Catch up with anything held back while unfocused
+			read_selected_conversation();
+			request_render();
+			mg_timer_free(&relayout_timer);
+			mg_timer_init(&relayout_timer, RELAYOUT_SETTLE_MS, 0, relayout_cache, NULL);
+		}
+		return;
+	}
+	if (evt->type == TB_EVENT_RESIZE) {
+		screen_width = evt->w;
+		screen_height = evt->h;
+		request_render();
+		return;
+	}
+	if (evt->type == TB_EVENT_KEY) {
+		if (evt->key == TB_KEY_ESC) {
+			set_current_mode(mode_normal);
+			return;
+		}
+		switch (get_current_mode()) {
+		case mode_normal:
+			handle_event_mode_normal(evt);
+			return;
+		case mode_insert:
+			handle_event_insert(evt);
+			return;
+		case mode_search:
+			handle_event_search(evt);
+			return;
+		case mode_goto:
+			handle_event_goto(evt);
+			return;
+		case mode_filter:
+			handle_event_filter(evt);
+			return;
+		case mode_export:
+			handle_event_export(evt);
+			return;
+		}
+	}
+}
+
+/*
+ * Handles initializing TLS and adding the relevant AUTHORIZATION header
+ */
 static void handle_connect(const char* url, struct mg_connection* c) {
 	// Connected to server
 	struct mg_str host = mg_url_host(url);
-	if (mg_url_is_ssl(url)) {
-		// If s_url is https://, tell client connection to use TLS
-		struct mg_tls_opts opts = {
-			.ca = "/etc/ssl/cert.pem"
-		};
-		mg_tls_init(c, &opts);
+	if (mg_url_is_ssl(url)) {
+		// If s_url is https://, tell client connection to use TLS
+		struct mg_tls_opts opts = {
+			.ca = "/etc/ssl/cert.pem"
+		};
+		mg_tls_init(c, &opts);
+	}
+	// Send request
+	mg_printf(c, "GET %s HTTP/1.0\r\n"
+			"Host: %.*s\r\n"
+			"Authorization: Bearer %s\r\n"
+			"\r\n\r\n", 
+			mg_url_uri(url),
+			(int) host.len, host.ptr,
+			getenv("SLACK_TOKEN"));
+}
+
+static const char* conversation_max_rowid_sql =
+	"select ifnull(max(rowid), 0) from conversation";
+
+static const char* insert_conversations_sql =
+	"insert into conversation "
+	"(id, name, is_member, is_im, user, did_fetch) "
+	"select "
+		"json_extract(value, '$.id'), "
+		"json_extract(value, '$.name'), "
+		"json_extract(value, '$.is_member'), "
+		"json_extract(value, '$.is_im'), "
+		"json_extract(value, '$.user'), "
+		"ifnull((select max(did_fetch) from conversation old "
+			"where old.id = json_extract(value, '$.id')), 0) "
+	"from json_each(?, '$.channels')";
+
+static const char* delete_old_conversations_sql =
+	"delete from conversation where rowid <= ?";
+
+// Where slack says a conversation was read up to, unless we know better
+static const char* seed_read_markers_sql =
+	"insert into read_marker (conversation, last_read, synced) "
+	"select "
+		"json_extract(value, '$.id'), "
+		"json_extract(value, '$.last_read'), "
+		"json_extract(value, '$.last_read') "
+	"from json_each(?, '$.channels') "
+	"where json_extract(value, '$.last_read') is not null "
+	"on conflict (conversation) "
+	"do update set last_read = excluded.last_read, "
+		"synced = excluded.synced "
+	"where excluded.last_read > ifnull(last_read, '')";
+
+static void handle_conversations(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
+	if (ev == MG_EV_CONNECT) {
+		handle_connect(slack_conversations_list_url ,c);
+	} else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+		sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
+		// History may have been fetched concurrently with this list
+		// during startup, so carry did_fetch over from the old rows
+		// before replacing them.
+		sqlite3_stmt* stmt;
+		sqlite_check(db, prepare_statement(db, conversation_max_rowid_sql, -1, &stmt, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
+		sqlite3_int64 old_max_rowid = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+		sqlite_check(db, prepare_statement(db, insert_conversations_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, hm->body.ptr, hm->body.len, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+		sqlite_check(db, prepare_statement(db, delete_old_conversations_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_int64(stmt, 1, old_max_rowid));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+		sqlite_check(db, prepare_statement(db, seed_read_markers_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, hm->body.ptr, hm->body.len, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+		sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
+	} else if (ev == MG_EV_ERROR) {
+		char* err = ev_data;
+		dbg("Error fetching conversations %s", err);
+	}
+
+}
+
+static const char* delete_users_sql =
+	"delete from user";
+static const char* insert_users_sql =
+	"insert into user "
+	"(id, name) "
+	"select "
+		"json_extract(value, '$.id'), "
+		"json_extract(value, '$.name') "
+	"from json_each(?, '$.members')";
+
+static void handle_users(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
+	if (ev == MG_EV_CONNECT) {
+		handle_connect(slack_users_list_url ,c);
+	} else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+		sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
+		sqlite_check(db, exec_statement(db, delete_users_sql));
+		sqlite3_stmt* stmt;
+		sqlite_check(db, prepare_statement(db, insert_users_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, hm->body.ptr, hm->body.len, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+		sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
+	} else if (ev == MG_EV_ERROR) {
+		char* err = ev_data;
+		dbg("Error fetching users %s", err);
+	}
+}
+
+static const char* ws_message_sql =
+	"with js(c) as (select json(?)) "
+	"insert into message "
+	"(type, conversation, ts, user, text) "
+	"select "
+		"json_extract(c, '$.type'),"
+		"json_extract(c, '$.channel'),"
+		"json_extract(c, '$.ts'),"
+		"json_extract(c, '$.user'),"
+		"json_extract(c, '$.text') "
+	"from js";
+
+void handle_ws_message(struct mg_str payload) {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, ws_message_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+}
+
+static const char* ws_presence_sql =
+	"with js(c) as (select json(?)) "
+	"select json_extract(c, '$.user'), json_extract(c, '$.presence') "
+	"from js "
+	"where json_extract(c, '$.user') is not null "
+	"union all "
+	"select u.value, json_extract(c, '$.presence') "
+	"from js, json_each(js.c, '$.users') u";
+
+void handle_ws_presence_change(struct mg_str payload) {
+	// Either a single user, or a batch of them
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, ws_presence_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
+	int v;
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		const char* user = sqlite3_column_text(stmt, 0);
+		const char* presence = sqlite3_column_text(stmt, 1);
+		set_presence(user, presence != NULL && strcmp(presence, "active") == 0);
+	}
+	if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	sqlite3_finalize(stmt);
+}
+
+static const char* ws_typing_sql =
+	"with js(c) as (select json(?)) "
+	"select json_extract(c, '$.user'), json_extract(c, '$.channel') "
+	"from js";
+
+void handle_ws_user_typing(struct mg_str payload) {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, ws_typing_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
+	const char* user = sqlite3_column_text(stmt, 0);
+	const char* channel = sqlite3_column_text(stmt, 1);
+	if (user != NULL && channel != NULL) {
+		set_typing(user, channel);
+	}
+	sqlite3_finalize(stmt);
+}
+
+static const char* ws_reaction_added_sql =
+	"with js(c) as (select json(?)) "
+	"insert into reaction "
+	"(conversation, ts, name, count) "
+	"select "
+		"json_extract(c, '$.item.channel'), "
+		"json_extract(c, '$.item.ts'), "
+		"json_extract(c, '$.reaction'), "
+		"1 "
+	"from js "
+	"where json_extract(c, '$.item.type') = 'message' "
+	"on conflict (conversation, ts, name) "
+	"do update set count = count + 1";
+
+static const char* ws_reaction_removed_sql =
+	"with js(c) as (select json(?)) "
+	"update reaction "
+	"set count = count - 1 "
+	"from js "
+	"where conversation = json_extract(c, '$.item.channel') "
+	"and ts = json_extract(c, '$.item.ts') "
+	"and name = json_extract(c, '$.reaction') ";
+
+static const char* ws_reaction_cleanup_sql =
+	"with js(c) as (select json(?)) "
+	"delete from reaction "
+	"where (conversation, ts, name) = ("
+		"select "
+			"json_extract(c, '$.item.channel'), "
+			"json_extract(c, '$.item.ts'), "
+			"json_extract(c, '$.reaction') "
+		"from js) "
+	"and count <= 0";
+
+/*
+ * Counts are adjusted in place, there's no need to recount. Only
+ * reactions to messages are tracked.
+ */
+void handle_ws_reaction(struct mg_str payload, bool added) {
+	sqlite3_stmt* stmt;
+	if (added) {
+		sqlite_check(db, prepare_statement(db, ws_reaction_added_sql, -1, &stmt, NULL));
+	} else {
+		sqlite_check(db, prepare_statement(db, ws_reaction_removed_sql, -1, &stmt, NULL));
+	}
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+	if (!added) {
+		sqlite_check(db, prepare_statement(db, ws_reaction_cleanup_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+	}
+}
+
+static const char* ws_marked_sql =
+	"with js(c) as (select json(?)) "
+	"insert into read_marker (conversation, last_read, synced) "
+	"select "
+		"json_extract(c, '$.channel'), "
+		"json_extract(c, '$.ts'), "
+		"json_extract(c, '$.ts') "
+	"from js "
+	"where json_extract(c, '$.channel') is not null "
+	"on conflict (conversation) "
+	"do update set last_read = excluded.last_read, "
+		"synced = excluded.synced";
+
+// Read on another device, or by us
+void handle_ws_marked(struct mg_str payload) {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, ws_marked_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+}
+
+static const char* ws_reply_sql =
+	"with js(c) as (select json(?)) "
+	"update message "
+	"set ts = json_extract(c, '$.ts'), "
+	    "text = json_extract(c, '$.text'),"
+	    "acknowledged = 1 "
+	"from js "
+	"where id = json_extract(c, '$.reply_to') "
+	"and json_extract(c, '$.ok') == 1 ";
+
+// A rejected chunk, and every chunk queued after it, won't be sent
+static const char* ws_reply_failed_sql =
+	"with recursive js(c) as (select json(?)), "
+	"chain(id) as ("
+		"select json_extract(c, '$.reply_to') from js "
+		"where json_extract(c, '$.ok') is not 1 "
+		"union all "
+		"select o.message_id from outbox o join chain on o.after = chain.id) "
+	"update message "
+	"set acknowledged = -1, pending = 0 "
+	"where id in chain";
+
+static const char* ws_reply_failed_outbox_sql =
+	"with recursive js(c) as (select json(?)), "
+	"chain(id) as ("
+		"select json_extract(c, '$.reply_to') from js "
+		"where json_extract(c, '$.ok') is not 1 "
+		"union all "
+		"select o.message_id from outbox o join chain on o.after = chain.id) "
+	"delete from outbox "
+	"where message_id in chain";
+
+static const char* ws_reply_outbox_sql =
+	"with js(c) as (select json(?)) "
+	"delete from outbox "
+	"where message_id = (select json_extract(c, '$.reply_to') from js) ";
+
+static const char* ws_reply_error_sql =
+	"with js(c) as (select json(?)) "
+	"select json_extract(c, '$.ok'), "
+	"coalesce(json_extract(c, '$.error.msg'), json_extract(c, '$.error'), 'unknown error') "
+	"from js";
+
+void handle_ws_reply(struct mg_str payload) {
+	dbg("handling reply %.*s", payload.len, payload.ptr);
+	// The failed chain is found through the outbox, so it goes before the
+	// rows are deleted. The chunk after an acknowledged one only needs the
+	// acknowledged message.
+	const char* statements[] = {
+		ws_reply_sql,
+		ws_reply_failed_sql,
+		ws_reply_failed_outbox_sql,
+		ws_reply_outbox_sql,
+	};
+	sqlite3_stmt* stmt;
+	for (int i=0; i<4; i++) {
+		sqlite_check(db, prepare_statement(db, statements[i], -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+	}
+	sqlite_check(db, prepare_statement(db, ws_reply_error_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
+	if (sqlite3_column_int(stmt, 0) != 1) {
+		char status[200];
+		snprintf(status, 200, "message not sent: %s", sqlite3_column_text(stmt, 1));
+		set_key_value_string("send_status", status);
+	}
+	sqlite3_finalize(stmt);
+}
+
+static const char* resend_unacknowledged_sql =
+	"update message "
+	"set pending = 1 "
+	"where acknowledged = 0 "
+	"and pending = 0";
+
+/*
+ * A chunk sent on a connection that closed before slack replied may never
+ * have arrived, so it's sent again on the new one.
+ */
+void resend_unacknowledged() {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, resend_unacknowledged_sql, -1, &stmt, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+}
+
+static void handle_rtm_connect(struct mg_connection *c, int ev, void *ev_data, void *fn_data);
+
+void reconnect_ws(void* arg) {
+	mg_http_connect(&mgr, slack_rtm_connect_url, handle_rtm_connect, NULL);
+}
+
+static const char* ws_type_sql =
+	"with js(c) as (select json(?)) "
+	"select "
+		"json_extract(c, '$.type'), "
+		"json_extract(c, '$.reply_to') "
+	"from js";
+
+static void handle_ws(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
+	if (ev == MG_EV_CONNECT) {
+		const char* url = (const char*)fn_data;
+		handle_connect(url, c);
+	} else if (ev == MG_EV_WS_MSG) {
+		struct mg_ws_message* wm = (struct mg_ws_message*)ev_data;
+		sqlite3_stmt* stmt;
+		sqlite_check(db, prepare_statement(db, ws_type_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, wm->data.ptr, wm->data.len, NULL));
+		int v = sqlite3_step(stmt);
+		if (v == SQLITE_ROW) {
+			const char* type = sqlite3_column_text(stmt, 0);
+			int reply_to = sqlite3_column_int(stmt, 1);
+			if (reply_to > 0) {
+				handle_ws_reply(wm->data);
+			} else if (type != NULL) {
+				if (strcmp(type, "hello") == 0) {
+					// Remember the new websocket connection so we can send stuff.
+					// Lists were already requested at startup, see bootstrap()
+					ws_connection = c;
+					// A new connection has no presence subscription yet
+					sqlite3_free(subscribed_users_json);
+					subscribed_users_json = NULL;
+					schedule_presence_sub();
+					resend_unacknowledged();
+				} else if (strcmp(type, "message") == 0) {
+					handle_ws_message(wm->data);
+				} else if (strcmp(type, "presence_change") == 0) {
+					handle_ws_presence_change(wm->data);
+				} else if (strcmp(type, "user_typing") == 0) {
+					handle_ws_user_typing(wm->data);
+				} else if (strcmp(type, "reaction_added") == 0) {
+					handle_ws_reaction(wm->data, true);
+				} else if (strcmp(type, "reaction_removed") == 0) {
+					handle_ws_reaction(wm->data, false);
+				} else if (strcmp(type, "channel_marked") == 0
+				        || strcmp(type, "group_marked") == 0
+				        || strcmp(type, "im_marked") == 0) {
+					handle_ws_marked(wm->data);
+				} else {
+					dbg("unhandled message type %s", type);
+				}
+			} else {
+				dbg("websocket message with no reply_to or type %.*s", wm->data.len, wm->data.ptr);
+			}
+		} else {
+			sqlite_check(db, v);
+		}
+		sqlite3_finalize(stmt);
+	} else if (ev == MG_EV_CLOSE) {
+		free(fn_data);
+		if (c == ws_connection) {
+			ws_connection = NULL;
+		}
+		// rtm.connect hands out a new websocket url each time
+		if (!quit) {
+			mg_timer_free(&ws_reconnect_timer);
+			mg_timer_init(&ws_reconnect_timer, WS_RECONNECT_MS, 0, reconnect_ws, NULL);
+		}
+	}
+}
+
+static const char* rtm_connect_sql =
+	"with js(c) as (select json(?)) "
+	"select json_extract(c, '$.url'), "
+		"json_extract(c, '$.self.id') "
+	"from js";
+
+static void handle_rtm_connect(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+	if (ev == MG_EV_CONNECT) {
+		handle_connect(slack_rtm_connect_url ,c);
+	} else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+		struct mg_str payload = hm->body;
+		sqlite3_stmt* stmt;
+		sqlite_check(db, prepare_statement(db, rtm_connect_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
+		const char* wss_url = sqlite3_column_text(stmt, 0);
+		const char* current_user_id = sqlite3_column_text(stmt, 1);
+		// Need to take a copy of the dynamic URL for the connect method later
+		mg_ws_connect(&mgr, wss_url, handle_ws, (void*)strdup(wss_url), NULL);
+		set_current_user_id(current_user_id);
+		c->is_closing = 1;
+	} 
+}
+
+void print_histogram(struct mg_connection* c, const char* name, struct histogram* h) {
+	mg_http_printf_chunk(c, "\"%s\":{\"total_us\":%lu,\"buckets\":[", name, h->total_us);
+	for (int i=0; i<LATENCY_BUCKETS; i++) {
+		mg_http_printf_chunk(c, "%s%lu", i == 0 ? "" : ",", h->counts[i]);
+	}
+	mg_http_printf_chunk(c, "]}");
+}
+
+// Only this machine can reach a listener on one of these
+bool is_loopback_url(const char* url) {
+	struct mg_str host = mg_url_host(url);
+	char ip[64];
+	snprintf(ip, 64, "%.*s", (int)host.len, host.ptr);
+	struct in_addr v4;
+	return mg_vcasecmp(&host, "localhost") == 0
+		|| strcmp(ip, "::1") == 0
+		|| (inet_pton(AF_INET, ip, &v4) == 1 && (ntohl(v4.s_addr) >> 24) == 127);
+}
+
+/*
+ * Serves metrics as JSON on /metrics, see SLACK_DEBUG_LISTEN
+ */
+static void handle_debug(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
+	if (ev != MG_EV_HTTP_MSG) {
+		return;
+	}
+	struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+	if (!mg_http_match_uri(hm, "/metrics")) {
+		mg_http_reply(c, 404, "", "not found\n");
+		return;
+	}
+	mg_printf(c, "HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/json\r\n"
+			"Transfer-Encoding: chunked\r\n\r\n");
+
+	mg_http_printf_chunk(c, "{\"connections\":[");
+	for (struct mg_connection* x = mgr.conns; x != NULL; x = x->next) {
+		const char* kind = x->fn == handle_ws ? "websocket"
+			: x->fn == handle_debug ? "debug"
+			: "http";
+		mg_http_printf_chunk(c, "%s{\"id\":%lu,\"kind\":\"%s\",\"tls\":%s,"
+				"\"listening\":%s,\"closing\":%s,"
+				"\"recv_len\":%lu,\"recv_size\":%lu,"
+				"\"send_len\":%lu,\"send_size\":%lu,"
+				"\"bytes_read\":%lu,\"bytes_written\":%lu}",
+				x == mgr.conns ? "" : ",",
+				x->id, kind, x->is_tls ? "true" : "false",
+				x->is_listening ? "true" : "false",
+				x->is_closing ? "true" : "false",
+				(unsigned long)x->recv.len, (unsigned long)x->recv.size,
+				(unsigned long)x->send.len, (unsigned long)x->send.size,
+				(unsigned long)x->bytes_read, (unsigned long)x->bytes_written);
+	}
+	mg_http_printf_chunk(c, "],");
+
+	sqlite3_int64 memory_used, memory_highwater;
+	sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &memory_used, &memory_highwater, 0);
+	int cache_used, cache_hit, cache_miss, cache_write, unused;
+	sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_USED, &cache_used, &unused, 0);
+	sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &cache_hit, &unused, 0);
+	sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &cache_miss, &unused, 0);
+	sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_WRITE, &cache_write, &unused, 0);
+	mg_http_printf_chunk(c, "\"sqlite\":{\"memory_used\":%lld,\"memory_highwater\":%lld,"
+			"\"cache_used\":%d,\"cache_hit\":%d,\"cache_miss\":%d,\"cache_write\":%d},",
+			memory_used, memory_highwater, cache_used, cache_hit, cache_miss, cache_write);
+
+	mg_http_printf_chunk(c, "\"layout_cache\":{\"len\":%d,\"hits\":%lu,\"misses\":%lu},",
+			layout_cache_len, layout_cache_hits, layout_cache_misses);
+
+	mg_http_printf_chunk(c, "\"queues\":{\"input\":%u,\"state\":%u},",
+			list_size(&input_update_queue), list_size(&state_update_queue));
+
+	mg_http_printf_chunk(c, "\"latency\":{");
+	print_histogram(c, "state_update", &state_update_latency);
+	mg_http_printf_chunk(c, ",");
+	print_histogram(c, "input", &input_latency);
+	mg_http_printf_chunk(c, ",");
+	print_histogram(c, "render", &render_latency);
+	mg_http_printf_chunk(c, "}}\n");
+	mg_http_printf_chunk(c, "");
+}
+
+void cleanup() {
+	mg_mgr_free(&mgr);
+	free_idle_cursors();
+	if (terminal_started) {
+		tb_shutdown();
+	}
+	fclose(errfile);
+	fclose(dbgfile);
+	if (read_db != db) {
+		sqlite3_close(read_db);
+	}
+	sqlite3_close(db);
+}
+
+static volatile sig_atomic_t sigint_in_progress = 0;
+void handle_term(int sig) {
+	if (sigint_in_progress) {
+		raise(sig);
+		return;
+	}
+	sigint_in_progress = 1;
+	cleanup();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+void update_hook(void* user_data, 
+		int operation, 
+		const char* database, 
+		const char* tablename, 
+		sqlite3_int64 rowid) {
+	struct state_update* u = database_update(database,
+			operation, 
+			tablename, 
+			rowid);
+	queue_state_update(u);
+}
+
+static const char* store_history_messages_sql =
+	"insert into message "
+	"(conversation, type, user, text, ts) "
+	"select "
+		"?1, "
+		"json_extract(value, '$.type'), "
+		"json_extract(value, '$.user'), "
+		"json_extract(value, '$.text'), "
+		"json_extract(value, '$.ts') "
+	"from json_each(?2, '$.messages') "
+	"where not exists ("
+		"select 1 from message m "
+		"where m.conversation = ?1 "
+		"and m.ts = json_extract(value, '$.ts'))";
+
+// Edited messages, only rows whose text changed are written
+static const char* store_history_edits_sql =
+	"update message "
+	"set text = p.text "
+	"from ("
+		"select "
+			"json_extract(value, '$.ts') as ts, "
+			"json_extract(value, '$.text') as text "
+		"from json_each(?2, '$.messages')) p "
+	"where message.conversation = ?1 "
+	"and message.ts = p.ts "
+	"and message.text is not p.text";
+
+// The page has every reaction of its messages, so theirs are replaced
+static const char* clear_history_reactions_sql =
+	"delete from reaction "
+	"where conversation = ?1 "
+	"and ts in (select json_extract(value, '$.ts') from json_each(?2, '$.messages'))";
+
+static const char* store_history_reactions_sql =
+	"insert or ignore into reaction "
+	"(conversation, ts, name, count) "
+	"select "
+		"?1, "
+		"json_extract(m.value, '$.ts'), "
+		"json_extract(r.value, '$.name'), "
+		"json_extract(r.value, '$.count') "
+	"from json_each(?2, '$.messages') m, "
+		"json_each(m.value, '$.reactions') r";
+
+/*
+ * Adds a page of conversations.history to what's cached, keeping any
+ * messages already there and updating their text and reactions.
+ */
+void store_history_page(const char* conversation_id, struct mg_str body) {
+	const char* statements[] = {
+		store_history_messages_sql,
+		store_history_edits_sql,
+		clear_history_reactions_sql,
+		store_history_reactions_sql,
+	};
+	sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
+	for (int i=0; i<sizeof(statements) / sizeof(statements[0]); i++) {
+		sqlite3_stmt* stmt;
+		sqlite_check(db, prepare_statement(db, statements[i], -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, conversation_id, -1, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 2, body.ptr, body.len, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+	}
+	sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
+}
+
+static void handle_conversation_history(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
+	char* selected_conversation_id = fn_data;
+	if (ev == MG_EV_CONNECT) {
+		char* url = format_url1(slack_conversation_history_url, selected_conversation_id);
+		handle_connect(url, c);
+		free(url);
+	} else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message* hm = ev_data;
+		dbg("handing conversation history %.*s", hm->body.len, hm->body.ptr);
+		// Older history, from seeks, exports and imports, stays cached
+		store_history_page(selected_conversation_id, hm->body);
+		c->is_closing = true;
+	} else if (ev == MG_EV_ERROR) {
+		char* error_message = ev_data;
+		dbg("Error fetching conversation history %s", error_message);
+		c->is_closing = true;
+	} else if (ev == MG_EV_CLOSE) {
+		// Also reached when the fetch is cancelled
+		free(selected_conversation_id);
+	}
+}
+
+static const char* history_page_meta_sql =
+	"select "
+		"json_extract(?1, '$.ok'), "
+		"json_extract(?1, '$.error'), "
+		"nullif(json_extract(?1, '$.response_metadata.next_cursor'), '')";
+
+/*
+ * Whether a page of conversations.history is ok. Sets cursor to the next
+ * page's, url encoded, or NULL on the last one, and error to slack's if
+ * it isn't ok and error isn't NULL. Caller frees both.
+ */
+bool read_history_page(struct mg_str body, char** cursor, char** error) {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, history_page_meta_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, body.ptr, body.len, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
+	bool ok = sqlite3_column_int(stmt, 0);
+	const char* e = sqlite3_column_text(stmt, 1);
+	const char* next = sqlite3_column_text(stmt, 2);
+	*cursor = ok && next != NULL ? url_encode(next) : NULL;
+	if (!ok && error != NULL) {
+		*error = strdup(e != NULL ? e : "unknown error");
+	}
+	sqlite3_finalize(stmt);
+	return ok;
+}
+
+/*
+ * History between two times, for seek_pane, fetched a page at a time
+ * following the cursor. Unlike a full history fetch this keeps what's
+ * cached and only adds what's missing.
+ */
+struct history_seek {
+	int pane;
+	char* conversation;
+	char* oldest;
+	char* latest;
+	// Of the page to fetch, "" for the first
+	char* cursor;
+};
+
+void seek_pane(int pane_id, const char* conversation_id, const char* ts, bool fetch);
+
+static void handle_history_range(struct mg_connection* c, int ev, void* ev_data, void* fn_data);
+
+void fetch_history_range(struct history_seek* h) {
+	char* url = format_url4(slack_conversation_history_page_url,
+			h->conversation, h->oldest, h->latest, h->cursor);
+	mg_http_connect(&mgr, url, handle_history_range, h);
+	free(url);
+}
+
+static void handle_history_range(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
+	struct history_seek* h = fn_data;
+	if (ev == MG_EV_CONNECT) {
+		char* url = format_url4(slack_conversation_history_page_url,
+				h->conversation, h->oldest, h->latest, h->cursor);
+		handle_connect(url, c);
+		free(url);
+	} else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message* hm = ev_data;
+		dbg("handling history from %s to %s in %s", h->oldest, h->latest, h->conversation);
+		c->is_closing = true;
+		char* cursor;
+		if (read_history_page(hm->body, &cursor, NULL)) {
+			store_history_page(h->conversation, hm->body);
+		}
+		if (cursor == NULL) {
+			seek_pane(h->pane, h->conversation, h->oldest, false);
+			return;
+		}
+		// The next page takes over h, this connection closes without it
+		struct history_seek* next = malloc(sizeof(struct history_seek));
+		*next = *h;
+		free(next->cursor);
+		next->cursor = cursor;
+		*h = (struct history_seek){0};
+		fetch_history_range(next);
+	} else if (ev == MG_EV_ERROR) {
+		char* error_message = ev_data;
+		dbg("Error fetching history range %s", error_message);
+		c->is_closing = true;
+		// Land on whatever is cached rather than nowhere
+		if (h->conversation != NULL) {
+			seek_pane(h->pane, h->conversation, h->oldest, false);
+		}
+	} else if (ev == MG_EV_CLOSE) {
+		free(h->conversation);
+		free(h->oldest);
+		free(h->latest);
+		free(h->cursor);
+		free(h);
+	}
+}
+/*
+ * An export streams a conversation, or part of it, to a file as JSON Lines
+ * or plain text. History the cache is missing is fetched first, a page at
+ * a time following the conversations.history cursor, and each page goes
+ * straight into message. Then a thread steps one statement over
+ * idx_message_conversation_ts, with the user names joined in, writing each
+ * row through a stdio buffer as it's read. Nothing is built up in memory,
+ * so a channel of millions of messages exports in a few hundred KB.
+ */
+enum export_format {
+	export_text,
+	export_jsonl
+};
+
+struct export {
+	char* conversation;
+	// ts range, oldest inclusive, latest exclusive
+	char* oldest;
+	char* latest;
+	char* path;
+	enum export_format format;
+	// History is fetched from oldest up to here, where the cache starts
+	char* fetch_latest;
+	// The next page of history
+	char* cursor;
+	int pages;
+	bool page_pending;
+	// Set by whoever waits on the export, rather than freeing it when done
+	bool waited_on;
+	bool done;
+	long rows;
+	// The export still goes ahead without the history it couldn't fetch
+	char* fetch_error;
+	char* error;
+};
+
+/*
+ * Times are parsed like in go to mode, until is exclusive. Path "-" is
+ * stdout, .jsonl or .json are exported as JSON Lines. NULL if a time
+ * doesn't parse.
+ */
+struct export* new_export(const char* conversation_id, const char* path,
+		const char* since, const char* until) {
+	char oldest[32] = "0";
+	char latest[32];
+	snprintf(latest, 32, "%ld.000000", (long)time(NULL) + 1);
+	if ((since != NULL && !parse_goto_time(since, oldest, 32))
+			|| (until != NULL && !parse_goto_time(until, latest, 32))) {
+		return NULL;
+	}
+	struct export* e = calloc(1, sizeof(struct export));
+	e->conversation = strdup(conversation_id);
+	e->oldest = strdup(oldest);
+	e->latest = strdup(latest);
+	e->path = strdup(path);
+	const char* ext = strrchr(path, '.');
+	e->format = ext != NULL && (strcmp(ext, ".jsonl") == 0 || strcmp(ext, ".json") == 0)
+		? export_jsonl : export_text;
+	return e;
+}
+
+void free_export(struct export* e) {
+	free(e->conversation);
+	free(e->oldest);
+	free(e->latest);
+	free(e->fetch_latest);
+	free(e->path);
+	free(e->cursor);
+	free(e->fetch_error);
+	free(e->error);
+	free(e);
+}
+
+void set_export_status(struct export* e) {
+	char status[300];
+	if (!e->done) {
+		snprintf(status, 300, "exporting, %d pages of history fetched", e->pages);
+	} else if (e->error != NULL) {
+		snprintf(status, 300, "export to %s failed: %s", e->path, e->error);
+	} else {
+		snprintf(status, 300, "exported %ld messages to %s%s%s", e->rows, e->path,
+				e->fetch_error != NULL ? ", history fetch failed: " : "",
+				e->fetch_error != NULL ? e->fetch_error : "");
 	}
-	// Send request
-	mg_printf(c, "GET %s HTTP/1.0\r\n"
-			"Host: %.*s\r\n"
-			"Authorization: Bearer %s\r\n"
-			"\r\n\r\n", 
-			mg_url_uri(url),
-			(int) host.len, host.ptr,
-			getenv("SLACK_TOKEN"));
+	set_key_value_string("export_status", status);
+}
+
+static const char* export_jsonl_sql =
+	"select json_object("
+		"'ts', m.ts, "
+		"'user', m.user, "
+		"'user_name', u.name, "
+		"'type', m.type, "
+		"'text', m.text) "
+	"from message m "
+	"left join user u "
+	  "on u.id = m.user "
+	"where m.conversation = ?1 "
+	"and m.ts >= ?2 "
+	"and m.ts < ?3 "
+	"order by m.ts";
+static const char* export_text_sql =
+	"select strftime('%Y-%m-%d %H:%M', cast(m.ts as real), 'unixepoch', 'localtime') "
+		"|| '  ' || ifnull(u.name, ifnull(m.user, '')) "
+		"|| '  ' || ifnull(m.text, '') "
+	"from message m "
+	"left join user u "
+	  "on u.id = m.user "
+	"where m.conversation = ?1 "
+	"and m.ts >= ?2 "
+	"and m.ts < ?3 "
+	"order by m.ts";
+
+/*
+ * Runs on a thread of its own with its own read connection, so the main
+ * thread and the workers carry on while a big export is written.
+ * Statements are prepared with sqlite3_prepare_v2, the query plan checks
+ * in prepare_statement are main thread only, --check-query-plans <db>
+ * checks them from statement_table instead.
+ */
+void write_export(void* arg) {
+	struct export* e = arg;
+	sqlite3* export_db;
+	sqlite3_stmt* stmt = NULL;
+	FILE* out = NULL;
+	if (sqlite3_open_v2(DB_PATH, &export_db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK
+			|| sqlite3_prepare_v2(export_db, e->format == export_jsonl
+				? export_jsonl_sql : export_text_sql, -1, &stmt, NULL) != SQLITE_OK) {
+		e->error = strdup(sqlite3_errmsg(export_db));
+		goto done;
+	}
+	sqlite3_bind_text(stmt, 1, e->conversation, -1, NULL);
+	sqlite3_bind_text(stmt, 2, e->oldest, -1, NULL);
+	sqlite3_bind_text(stmt, 3, e->latest, -1, NULL);
+	out = strcmp(e->path, "-") == 0 ? stdout : fopen(e->path, "w");
+	if (out == NULL) {
+		e->error = strdup(strerror(errno));
+		goto done;
+	}
+	setvbuf(out, NULL, _IOFBF, EXPORT_BUFFER_SIZE);
+	int v;
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		const char* line = sqlite3_column_text(stmt, 0);
+		if (line != NULL) {
+			fputs(line, out);
+		}
+		fputc('\n', out);
+		e->rows++;
+	}
+	if (v != SQLITE_DONE) {
+		e->error = strdup(sqlite3_errmsg(export_db));
+	}
+	if ((out == stdout ? fflush(out) : fclose(out)) != 0 && e->error == NULL) {
+		e->error = strdup(strerror(errno));
+	}
+done:
+	sqlite3_finalize(stmt);
+	sqlite3_close(export_db);
+}
+
+void export_written(void* arg) {
+	struct export* e = arg;
+	e->done = true;
+	dbg("exported %ld messages of %s to %s", e->rows, e->conversation, e->path);
+	set_export_status(e);
+	if (!e->waited_on) {
+		free_export(e);
+	}
+}
+
+static void handle_export_page(struct mg_connection* c, int ev, void* ev_data, void* fn_data);
+
+void fetch_export_page(struct export* e) {
+	char* url = format_url4(slack_conversation_history_page_url, e->conversation,
+			e->oldest, e->fetch_latest, e->cursor != NULL ? e->cursor : "");
+	e->page_pending = true;
+	mg_http_connect(&mgr, url, handle_export_page, e);
+	free(url);
+}
+
+static void handle_export_page(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
+	struct export* e = fn_data;
+	if (ev == MG_EV_CONNECT) {
+		char* url = format_url4(slack_conversation_history_page_url, e->conversation,
+				e->oldest, e->fetch_latest, e->cursor != NULL ? e->cursor : "");
+		handle_connect(url, c);
+		free(url);
+	} else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message* hm = ev_data;
+		c->is_closing = true;
+		e->page_pending = false;
+		free(e->cursor);
+		if (read_history_page(hm->body, &e->cursor, &e->fetch_error)) {
+			store_history_page(e->conversation, hm->body);
+			e->pages++;
+			set_export_status(e);
+		}
+		if (e->cursor != NULL) {
+			fetch_export_page(e);
+		} else {
+			submit_long_task(write_export, export_written, e);
+		}
+	} else if (ev == MG_EV_ERROR) {
+		char* error_message = ev_data;
+		dbg("Error fetching history to export %s", error_message);
+		c->is_closing = true;
+		if (e->page_pending && e->fetch_error == NULL) {
+			e->fetch_error = strdup(error_message);
+		}
+	} else if (ev == MG_EV_CLOSE) {
+		// Closed without a page, write what's cached
+		if (e->page_pending && !quit) {
+			e->page_pending = false;
+			if (e->fetch_error == NULL) {
+				e->fetch_error = strdup("connection closed");
+			}
+			submit_long_task(write_export, export_written, e);
+		}
+	}
+}
+
+static const char* oldest_cached_sql =
+	"select min(ts) from message where conversation = ?";
+
+/*
+ * Only history older than the oldest cached message is fetched, like
+ * seek_pane, and none if the cache already reaches back far enough.
+ * Without a token there's nothing to fetch, so only the cached history is
+ * exported.
+ */
+void start_export(struct export* e) {
+	set_export_status(e);
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, oldest_cached_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, e->conversation, -1, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
+	const char* oldest = sqlite3_column_text(stmt, 0);
+	if (oldest == NULL || strcmp(oldest, e->oldest) > 0) {
+		e->fetch_latest = strdup(oldest != NULL && strcmp(oldest, e->latest) < 0 ? oldest : e->latest);
+	}
+	sqlite3_finalize(stmt);
+	if (getenv("SLACK_TOKEN") != NULL && e->fetch_latest != NULL) {
+		fetch_export_page(e);
+	} else {
+		submit_long_task(write_export, export_written, e);
+	}
+}
+
+/*
+ * Read markers are tracked locally in read_marker, and sent to slack
+ * with conversations.mark. Only one request per conversation is in
+ * flight at a time, whatever was read in the meantime goes next.
+ */
+struct read_mark {
+	char* conversation;
+	char* ts;
+};
+
+void flush_read_marker(const char* conversation_id);
+
+static const char* mark_synced_sql =
+	"update read_marker "
+	"set synced = ? "
+	"where conversation = ? "
+	"and json_extract(?, '$.ok') = 1";
+
+static void handle_mark(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
+	struct read_mark* rm = fn_data;
+	if (ev == MG_EV_CONNECT) {
+		char* url = format_url2(slack_conversations_mark_url, rm->conversation, rm->ts);
+		handle_connect(url, c);
+		free(url);
+	} else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message* hm = ev_data;
+		c->is_closing = true;
+		sqlite3_stmt* stmt;
+		sqlite_check(db, prepare_statement(db, mark_synced_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, rm->ts, -1, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 2, rm->conversation, -1, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 3, hm->body.ptr, hm->body.len, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+		// Anything read while this was in flight
+		flush_read_marker(rm->conversation);
+	} else if (ev == MG_EV_ERROR) {
+		char* err = ev_data;
+		dbg("Error marking conversation read %s", err);
+		c->is_closing = true;
+	} else if (ev == MG_EV_CLOSE) {
+		free(rm->conversation);
+		free(rm->ts);
+		free(rm);
+	}
+}
+
+bool is_mark_in_flight(const char* conversation_id) {
+	for (struct mg_connection* c = mgr.conns; c != NULL; c = c->next) {
+		if (c->fn == handle_mark && !c->is_closing
+		  && strcmp(((struct read_mark*)c->fn_data)->conversation, conversation_id) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static const char* unsynced_marker_sql =
+	"select last_read "
+	"from read_marker "
+	"where conversation = ? "
+	"and last_read > ifnull(synced, '')";
+
+// Sends the latest read marker for the conversation, if slack doesn't have it
+void flush_read_marker(const char* conversation_id) {
+	if (conversation_id == NULL || is_mark_in_flight(conversation_id)) {
+		return;
+	}
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, unsynced_marker_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, conversation_id, -1, NULL));
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		struct read_mark* rm = malloc(sizeof(struct read_mark));
+		rm->conversation = strdup(conversation_id);
+		rm->ts = strdup(sqlite3_column_text(stmt, 0));
+		dbg("marking %s read up to %s", rm->conversation, rm->ts);
+		char* url = format_url2(slack_conversations_mark_url, rm->conversation, rm->ts);
+		mg_http_connect(&mgr, url, handle_mark, rm);
+		free(url);
+	} else if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	sqlite3_finalize(stmt);
+}
+
+static const char* mark_read_sql =
+	"insert into read_marker (conversation, last_read) "
+	"select conversation, max(ts) "
+	"from message "
+	"where conversation = ? "
+	"and acknowledged = 1 "
+	"group by conversation "
+	"on conflict (conversation) "
+	"do update set last_read = excluded.last_read "
+	"where excluded.last_read > ifnull(last_read, '')";
+
+// Records the newest message in the conversation as read, locally
+void mark_conversation_read(const char* conversation_id) {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, mark_read_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, conversation_id, -1, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+}
+
+void flush_selected_read_marker(void* arg) {
+	read_mark_timer_armed = false;
+	char* selected_conversation_id = get_selected_conversation();
+	flush_read_marker(selected_conversation_id);
+	free(selected_conversation_id);
+}
+
+bool did_key_change(struct state_update* u, const char* expected_key) {
+	if (strcmp(u->tablename, "kvs") != 0) {
+		return false;
+	}
+	char* key = get_key_value_key_by_rowid(u->rowid);
+	bool changed = key != NULL && strcmp(key, expected_key) == 0;
+	free(key);
+	return changed;
+}
+
+static const char* search_conversation_list_sql =
+	"insert /* full scan */ into conversation_list (id, next, prev, idx, display_name) "
+	"with tmp(id, display_name, is_member, is_im) as ("
+		"select c.id, "
+			"case when is_im = 1 then ifnull(u.name, 'Unknown user!') else c.name end as display_name, "
+			"c.is_member, "
+			"c.is_im "
+		"from conversation c "
+		"left outer join user u on u.id = c.user "
+	")"
+	"select id, "
+		"lead(id, 1) over win, "
+		"lag(id, 1) over win, "
+		"(row_number() over win) - 1, "
+		"display_name "
+	"from tmp "
+	"where (is_member = 1 or is_im = 1) "
+	"and display_name like ? "
+	"window win as (order by display_name) ";
+static const char* clear_conversation_list_sql =
+	"delete from conversation_list";
+static const char* fill_conversation_list_sql =
+	"insert /* full scan */ into conversation_list (id, next, prev, idx, display_name) "
+	"with tmp(id, display_name, is_member, is_im) as ("
+		"select c.id, "
+			"case when is_im = 1 then ifnull(u.name, 'Unknown user!') else c.name end as display_name, "
+			"c.is_member, "
+			"c.is_im "
+		"from conversation c "
+		"left outer join user u on u.id = c.user "
+	")"
+	"select id, "
+		"lead(id, 1) over win, "
+		"lag(id, 1) over win, "
+		"(row_number() over win) - 1, "
+		"display_name "
+	"from tmp "
+	"where (is_member = 1 or is_im = 1) "
+	"window win as (order by display_name) ";
+
+// Build up the conversations list for left hand panel
+// If the conversation table changes, or the search input buffer
+void update_conversations_list(struct state_update* u) {
+	bool table_changed = strcmp(u->tablename, "conversation") == 0
+		|| strcmp(u->tablename, "user") == 0;
+	if (!table_changed && !did_key_change(u, "search_input_buffer")) {
+		return;
+	}
+	// Bulk loads queue one update per row, only rebuild for the last of a run
+	struct state_update* next = peek_state_update();
+	if (table_changed && next != NULL && strcmp(next->tablename, u->tablename) == 0) {
+		return;
+	}
+	sqlite_check(db, exec_statement(db, clear_conversation_list_sql));
+	struct input_buffer* sb = load_input_buffer(&search_input_buffer);
+	if (input_buffer_len(sb) > 0) {
+		sqlite3_str* str = sqlite3_str_new(db);
+		char* sc = input_buffer_to_utf8(sb);
+		sqlite3_str_appendall(str, sc);
+		sqlite3_str_appendchar(str, 1, '%');
+		char* p = sqlite3_str_finish(str);
+		free(sc);
+		sqlite3_stmt* stmt;
+		sqlite_check(db, prepare_statement(db, search_conversation_list_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, p, -1, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_free(p);
+		sqlite3_finalize(stmt);
+	} else {
+		sqlite_check(db, exec_statement(db, fill_conversation_list_sql));
+	}
+}
+
+void update_completion_index(struct completion_index* idx, struct state_update* u) {
+	if (strcmp(u->tablename, idx->tablename) != 0) {
+		return;
+	}
+	// Bulk loads are cheaper to rebuild once than to insert row by row
+	struct state_update* next = peek_state_update();
+	if (next != NULL && strcmp(next->tablename, u->tablename) == 0) {
+		idx->stale = true;
+		return;
+	}
+	if (idx->stale) {
+		completion_index_rebuild(idx);
+		return;
+	}
+	if (u->operation != SQLITE_INSERT) {
+		completion_index_remove(idx, u->rowid);
+	}
+	if (u->operation != SQLITE_DELETE) {
+		completion_index_add(idx, u->rowid);
+	}
+}
+
+void update_completion_indexes(struct state_update* u) {
+	update_completion_index(&user_completions, u);
+	update_completion_index(&channel_completions, u);
+}
+
+// Drop cached layouts of messages that changed. Expanding one doesn't
+// need to, get_layout wraps it again when its expanded flag differs.
+void invalidate_layouts(struct state_update* u) {
+	if (strcmp(u->tablename, "message") != 0 || u->operation == SQLITE_INSERT) {
+		return;
+	}
+	remove_layout(u->rowid);
+}
+
+// The conversation of a changed row, and whether it's unread
+static const char* message_conversation_sql =
+	"select m.conversation, m.ts > ifnull(rm.last_read, '') "
+	"from message m "
+	"left join read_marker rm "
+	  "on rm.conversation = m.conversation "
+	"where m.id = ?";
+static const char* reaction_conversation_sql =
+	"select r.conversation, r.ts > ifnull(rm.last_read, '') "
+	"from reaction r "
+	"left join read_marker rm "
+	  "on rm.conversation = r.conversation "
+	"where r.rowid = ?";
+static const char* expanded_conversation_sql =
+	"select e.conversation, e.ts > ifnull(rm.last_read, '') "
+	"from expanded_message e "
+	"left join read_marker rm "
+	  "on rm.conversation = e.conversation "
+	"where e.rowid = ?";
+
+/*
+ * Marks the panes showing a conversation that changed for redrawing.
+ * Names show in every pane, so those changes redraw them all.
+ */
+void mark_panes_dirty(struct state_update* u) {
+	const char* sql;
+	if (strcmp(u->tablename, "message") == 0) {
+		sql = message_conversation_sql;
+	} else if (strcmp(u->tablename, "reaction") == 0) {
+		sql = reaction_conversation_sql;
+	} else if (strcmp(u->tablename, "expanded_message") == 0) {
+		sql = expanded_conversation_sql;
+	} else if (strcmp(u->tablename, "user") == 0 || strcmp(u->tablename, "conversation") == 0) {
+		mark_pane_dirty(NULL, true);
+		return;
+	} else if (strcmp(u->tablename, "read_marker") == 0) {
+		mark_pane_dirty(UNREADS_CONVERSATION, true);
+		return;
+	} else {
+		return;
+	}
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_int64(stmt, 1, u->rowid));
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		mark_pane_dirty(sqlite3_column_text(stmt, 0), sqlite3_column_int(stmt, 1));
+	} else if (v == SQLITE_DONE) {
+		// Gone, so there's no telling where it was
+		mark_pane_dirty(NULL, true);
+	} else {
+		sqlite_check(db, v);
+	}
+	sqlite3_finalize(stmt);
+}
+
+static const char* follow_selection_sql =
+	"update pane "
+	"set conversation = ?1, anchor = null "
+	"where id = ?2 "
+	"and conversation is not ?1";
+
+// The active pane shows whatever conversation is selected
+void follow_selection(struct state_update* u) {
+	if (!did_key_change(u, "selected_conversation")) {
+		return;
+	}
+	char* selected_conversation_id = get_selected_conversation();
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, follow_selection_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, selected_conversation_id, -1, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 2, get_active_pane()));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+	free(selected_conversation_id);
+}
+
+static const char* active_pane_following_sql =
+	"select anchor is null from pane where id = ?";
+
+// Only the newest messages on a focused terminal have been seen
+bool is_newest_visible() {
+	if (!focused) {
+		return false;
+	}
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, active_pane_following_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, get_active_pane()));
+	bool following = true;
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		following = sqlite3_column_int(stmt, 0);
+	} else {
+		sqlite_check_ex(db, v, SQLITE_DONE);
+	}
+	sqlite3_finalize(stmt);
+	return following;
+}
+
+void read_selected_conversation() {
+	if (!is_newest_visible()) {
+		return;
+	}
+	char* selected_conversation_id = get_selected_conversation();
+	if (selected_conversation_id == NULL) {
+		return;
+	}
+	mark_conversation_read(selected_conversation_id);
+	free(selected_conversation_id);
+	if (!read_mark_timer_armed) {
+		read_mark_timer_armed = true;
+		mg_timer_init(&read_mark_timer, READ_MARK_DWELL_MS, 0,
+				flush_selected_read_marker, NULL);
+	}
+}
+
+/*
+ * The selected conversation is read as messages arrive, while the active
+ * pane follows its newest messages. Scrolling back to them catches up. The
+ * marker is sent once the timer fires, so a busy channel sends one mark per
+ * READ_MARK_DWELL_MS at most. Switching away sends it straight away.
+ */
+void mark_selected_read(struct state_update* u) {
+	static char* previous_conversation_id;
+	bool selection_changed = did_key_change(u, "selected_conversation");
+	if (!selection_changed
+			&& strcmp(u->tablename, "message") != 0
+			&& strcmp(u->tablename, "pane") != 0) {
+		return;
+	}
+	struct state_update* next = peek_state_update();
+	if (!selection_changed && next != NULL && strcmp(next->tablename, u->tablename) == 0) {
+		return;
+	}
+	if (selection_changed) {
+		flush_read_marker(previous_conversation_id);
+		free(previous_conversation_id);
+		previous_conversation_id = get_selected_conversation();
+	}
+	read_selected_conversation();
+}
+
+// Takes ownership of conversation_id
+void fetch_conversation_history(char* conversation_id) {
+	char* url = format_url1(slack_conversation_history_url, conversation_id);
+	mg_http_connect(&mgr, url, handle_conversation_history, (void*)conversation_id);
+	set_conversation_did_fetch(conversation_id, true);
+	free(url);
+}
+
+// ?1 is the conversation, ?2 the filtered user and ?3 the ts
+static const char* seek_messages_sql =
+	"select m.id, m.text, m.ts, "
+		"exists(select 1 from expanded_message e where e.conversation = m.conversation and e.ts = m.ts), "
+		"exists(select 1 from reaction r where r.conversation = m.conversation and r.ts = m.ts) "
+	"from message m "
+	"where m.conversation = ?1 "
+	"and m.ts >= ?3 "
+	"order by m.ts";
+static const char* seek_user_messages_sql =
+	"select m.id, m.text, m.ts, "
+		"exists(select 1 from expanded_message e where e.conversation = m.conversation and e.ts = m.ts), "
+		"exists(select 1 from reaction r where r.conversation = m.conversation and r.ts = m.ts) "
+	"from message m "
+	"where m.conversation = ?1 "
+	"and m.user = ?2 "
+	"and m.ts >= ?3 "
+	"order by m.ts";
+static const char* seek_user_messages_everywhere_sql =
+	"select m.id, m.text, m.ts, "
+		"exists(select 1 from expanded_message e where e.conversation = m.conversation and e.ts = m.ts), "
+		"exists(select 1 from reaction r where r.conversation = m.conversation and r.ts = m.ts) "
+	"from message m "
+	"where m.user = ?2 "
+	"and m.ts >= ?3 "
+	"order by m.ts";
+
+static const char* seek_anchor_sql =
+	"update pane set anchor = ? where id = ? and conversation = ?";
+
+/*
+ * Points a pane at the first message at or after ts, found with one seek
+ * on idx_message_conversation_ts. A pane's anchor is the newest message it
+ * shows, so the anchor is walked forward a pane's worth of lines to put
+ * that message at the top, counting only what the pane's filter lets
+ * through. If the cached history doesn't reach back to ts that range is
+ * fetched first, and the seek finishes when it lands. A filter for every
+ * conversation only seeks through what's cached.
+ */
+void seek_pane(int pane_id, const char* conversation_id, const char* ts, bool fetch) {
+	struct pane filter;
+	read_pane(pane_id, &filter);
+	const char* sql = filter.user == NULL ? seek_messages_sql
+		: filter.everywhere ? seek_user_messages_everywhere_sql
+		: seek_user_messages_sql;
+	sqlite3_stmt* stmt;
+	if (fetch && !filter.everywhere) {
+		sqlite_check(db, prepare_statement(db, oldest_cached_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, conversation_id, -1, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
+		const char* oldest = sqlite3_column_text(stmt, 0);
+		if (oldest == NULL || strcmp(oldest, ts) > 0) {
+			char latest[32];
+			snprintf(latest, 32, "%ld.000000", atol(ts) + HISTORY_SEEK_WINDOW_S);
+			struct history_seek* h = malloc(sizeof(struct history_seek));
+			h->pane = pane_id;
+			h->conversation = strdup(conversation_id);
+			h->oldest = strdup(ts);
+			h->latest = strdup(oldest != NULL && strcmp(oldest, latest) < 0 ? oldest : latest);
+			h->cursor = strdup("");
+			sqlite3_finalize(stmt);
+			free_pane(&filter);
+			fetch_history_range(h);
+			return;
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	int height = screen_height;
+	for (int i=0; i<panes_len; i++) {
+		if (panes[i].id == pane_id && panes[i].frame != NULL) {
+			// Less the header, a pane that isn't following has one
+			height = panes[i].frame->height - 1;
+		}
+	}
+	sqlite_check(db, prepare_statement(db, sql, -1, &stmt, NULL));
+	if (!filter.everywhere) {
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, conversation_id, -1, NULL));
+	}
+	if (filter.user != NULL) {
+		sqlite_check(db, sqlite3_bind_text(stmt, 2, filter.user, -1, NULL));
+	}
+	sqlite_check(db, sqlite3_bind_text(stmt, 3, ts, -1, NULL));
+	char* anchor = NULL;
+	int lines = 0;
+	int day = -1;
+	int v;
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		struct layout* l = get_layout(sqlite3_column_int64(stmt, 0),
+				sqlite3_column_text(stmt, 1),
+				sqlite3_column_text(stmt, 2),
+				sqlite3_column_int(stmt, 3),
+				layout_width);
+		lines += l->lines_len + (l->collapsed ? 1 : 0) + sqlite3_column_int(stmt, 4);
+		if (day != -1 && l->day != day) {
+			lines++;
+		}
+		day = l->day;
+		if (anchor != NULL && lines > height) {
+			break;
+		}
+		free(anchor);
+		anchor = strdup(sqlite3_column_text(stmt, 2));
+	}
+	if (v == SQLITE_DONE) {
+		// The rest fits, so follow new messages
+		free(anchor);
+		anchor = NULL;
+	} else if (v != SQLITE_ROW) {
+		sqlite_check(db, v);
+	}
+	sqlite3_finalize(stmt);
+	free_pane(&filter);
+
+	sqlite_check(db, prepare_statement(db, seek_anchor_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, anchor, -1, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 2, pane_id));
+	sqlite_check(db, sqlite3_bind_text(stmt, 3, conversation_id, -1, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+	free(anchor);
+}
+
+/*
+ * Drop in-flight history fetches for anything but the given conversation,
+ * they are for conversations the user has already moved past. They get
+ * fetched again if the user comes back.
+ */
+void cancel_history_fetches_except(const char* conversation_id) {
+	for (struct mg_connection* c = mgr.conns; c != NULL; c = c->next) {
+		if (c->fn != handle_conversation_history || c->is_closing) {
+			continue;
+		}
+		const char* id = c->fn_data;
+		if (conversation_id != NULL && strcmp(id, conversation_id) == 0) {
+			continue;
+		}
+		dbg("cancelling history fetch for %s", id);
+		set_conversation_did_fetch(id, false);
+		c->is_closing = true;
+	}
+}
+
+void fetch_selected_conversation_now(void* arg) {
+	char* selected_conversation_id = get_selected_conversation();
+	if (selected_conversation_id == NULL) {
+		return;
+	}
+	if  (get_conversation_did_fetch(selected_conversation_id)) {
+		free(selected_conversation_id);
+		return;
+	}
+	fetch_conversation_history(selected_conversation_id);
 }
 
-static void handle_conversations(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
-	if (ev == MG_EV_CONNECT) {
-		handle_connect(slack_conversations_list_url ,c);
-	} else if (ev == MG_EV_HTTP_MSG) {
-		struct mg_http_message* hm = (struct mg_http_message*)ev_data;
-		sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
-		sqlite_check(db, sqlite3_exec(db, "delete from conversation", NULL, NULL, NULL));
-		sqlite3_stmt* stmt;
-		sqlite_check(db, sqlite3_prepare_v2(db, 
-					"insert into conversation "
-					"(id, name, is_member, is_im, user) "
-					"select "
-						"json_extract(value, '$.id'), "
-						"json_extract(value, '$.name'), "
-						"json_extract(value, '$.is_member'), "
-						"json_extract(value, '$.is_im'), "
-						"json_extract(value, '$.user') "
-					"from json_each(?, '$.channels')", -1, &stmt, NULL));
-		sqlite_check(db, sqlite3_bind_text(stmt, 1, hm->body.ptr, hm->body.len, NULL));
-		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
-		sqlite3_finalize(stmt);
-		sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
-	} else if (ev == MG_EV_ERROR) {
-		char* err = ev_data;
-		dbg("Error fetching conversations %s", err);
+void fetch_selected_conversation(struct state_update* u) {
+	if (!did_key_change(u, "selected_conversation")) {
+		return;
 	}
+	char* selected_conversation_id = get_selected_conversation();
+	cancel_history_fetches_except(selected_conversation_id);
+	free(selected_conversation_id);
+	// (Re)start the dwell timer, only fetch once the selection settles
+	mg_timer_free(&history_fetch_timer);
+	mg_timer_init(&history_fetch_timer, HISTORY_FETCH_DWELL_MS, 0,
+			fetch_selected_conversation_now, NULL);
+}
 
+void reset_search(struct state_update* u) {
+	if (!did_key_change(u, "mode")) {
+		return;
+	}
+	if (get_current_mode() == mode_search) {
+		clear_input_buffer(load_input_buffer(&search_input_buffer));
+	}
+	if (get_current_mode() == mode_goto) {
+		clear_input_buffer(load_input_buffer(&goto_input_buffer));
+	}
+	if (get_current_mode() == mode_filter) {
+		clear_input_buffer(load_input_buffer(&filter_input_buffer));
+	}
+	if (get_current_mode() == mode_export) {
+		clear_input_buffer(load_input_buffer(&export_input_buffer));
+	}
+	persist_input_buffers(NULL);
 }
 
-static void handle_users(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
-	if (ev == MG_EV_CONNECT) {
-		handle_connect(slack_users_list_url ,c);
-	} else if (ev == MG_EV_HTTP_MSG) {
-		struct mg_http_message* hm = (struct mg_http_message*)ev_data;
-		sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
-		sqlite_check(db, sqlite3_exec(db, "delete from user", NULL, NULL, NULL));
-		sqlite3_stmt* stmt;
-		sqlite_check(db, sqlite3_prepare_v2(db, 
-					"insert into user "
-					"(id, name) "
-					"select "
-						"json_extract(value, '$.id'), "
-						"json_extract(value, '$.name') "
-					"from json_each(?, '$.members')", -1, &stmt, NULL));
-		sqlite_check(db, sqlite3_bind_text(stmt, 1, hm->body.ptr, hm->body.len, NULL));
-		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
-		sqlite3_finalize(stmt);
-		sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
-	} else if (ev == MG_EV_ERROR) {
-		char* err = ev_data;
-		dbg("Error fetching users %s", err);
+void select_only_conversation(struct state_update* u) {
+	if (strcmp(u->tablename, "conversation_list") != 0) {
+		return;
+	}
+	if (count_conversations() == 1) {
+		select_first_conversation();
 	}
 }
 
-void handle_ws_message(struct mg_str payload) {
-	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"with js(c) as (select json(?)) "
-				"insert into message "
-				"(type, conversation, ts, user, text) "
-				"select "
-					"json_extract(c, '$.type'),"
-					"json_extract(c, '$.channel'),"
-					"json_extract(c, '$.ts'),"
-					"json_extract(c, '$.user'),"
-					"json_extract(c, '$.text') "
-				"from js"
-				, -1, &stmt, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
-	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
-	sqlite3_finalize(stmt);
+/*
+ * Runs listeners for queued updates until the queue is empty or
+ * budget_ms has passed, whatever is left is picked up next time round
+ * the main loop. That way a big ingest can't stall input handling.
+ */
+bool process_state_update_queue(int budget_ms) {
+	bool did_process = false;
+	unsigned long deadline = mg_millis() + budget_ms;
+	for (struct state_update* u = next_state_update();
+			u != NULL;
+			u = next_state_update()) {
+		did_process = true;
+		unsigned long start = micros();
+		for (int i=0; i<list_size(&state_listeners); i++) {
+			void (*fn)(struct state_update*) = list_get_at(&state_listeners,i);
+			fn(u);
+		}
+		free_state_update(u);
+		record_latency(&state_update_latency, micros() - start);
+		if (mg_millis() >= deadline) {
+			break;
+		}
+	}
+	return did_process;
 }
 
-void handle_ws_hello(struct mg_str payload) {
+static const char* reset_fetch_state_sql =
+	"update /* full scan */ conversation set did_fetch = 0;"
+	"delete from kvs where key in ('export_status', 'send_status')";
+
+/*
+ * Issue everything needed for a cold start at once, rather than waiting
+ * on rtm.connect and the websocket hello. The conversation and user lists
+ * can arrive in any order: update_conversations_list rebuilds on either.
+ */
+void bootstrap() {
+	// History from a previous run is stale, let it be fetched again
+	sqlite_check(db, exec_statement(db, reset_fetch_state_sql));
+	mg_http_connect(&mgr, 
+			slack_rtm_connect_url,
+			handle_rtm_connect,
+			NULL);
 	mg_http_connect(&mgr, 
 			slack_conversations_list_url, 
 			handle_conversations, 
@@ -1047,332 +5540,975 @@ void handle_ws_hello(struct mg_str payload) {
 			slack_users_list_url,
 			handle_users,
 			NULL);
+	char* selected_conversation_id = get_selected_conversation();
+	if (selected_conversation_id != NULL) {
+		fetch_conversation_history(selected_conversation_id);
+	}
 }
 
-void handle_ws_reply(struct mg_str payload) {
-	dbg("handling reply %.*s", payload.len, payload.ptr);
+// Created after an import rather than kept up to date row by row
+static const char* message_index_script =
+	"create index if not exists idx_message_conversation_ts on message(conversation, ts);"
+	"create index if not exists idx_message_pending on message(id) where pending = 1;"
+	"create index if not exists idx_message_unacknowledged on message(id) where acknowledged = 0;"
+	"create index if not exists idx_message_conversation_user_ts on message(conversation, user, ts);"
+	"create index if not exists idx_message_user_ts on message(user, ts)";
+
+static const char* drop_message_index_script =
+	"drop index if exists idx_message_conversation_ts;"
+	"drop index if exists idx_message_pending;"
+	"drop index if exists idx_message_unacknowledged;"
+	"drop index if exists idx_message_conversation_user_ts;"
+	"drop index if exists idx_message_user_ts";
+
+static const char* old_expanded_message_sql =
+	"select 1 from pragma_table_info('expanded_message') where name = 'id'";
+
+// Only has to find whether pane has any row at all
+static const char* create_first_pane_sql =
+	"insert /* full scan */ into pane (id, conversation) "
+	"select 1, (select value from kvs where key = 'selected_conversation') "
+	"where not exists (select 1 from pane)";
+
+// Left behind by panes closed before close_pane cleared them
+static const char* orphan_pane_filters_sql =
+	"delete /* full scan */ from pane_filter "
+	"where pane not in (select id from pane)";
+
+void init_database(const char* path) {
+	if (sqlite3_open(path, &db) != SQLITE_OK) {
+		fprintf(errfile, "Failed to open database %s", sqlite3_errmsg(db));
+		raise(SIGTERM);
+	}
+	// Readers see a consistent snapshot and never wait for a write
+	// transaction to finish, like a big history ingest
+	sqlite_check(db, sqlite3_exec(db, 
+				"pragma journal_mode = wal;"
+				"pragma synchronous = normal", NULL, NULL, NULL));
+	const char* init_script =
+				// Generic key-value store! Don't specify a datatype
+				"create table if not exists kvs (key text primary key, value);"
+
+				// Conversations
+				"create table if not exists conversation "
+				"(id text, "
+				"name text, "
+				"is_member int, "
+				"is_im int, "
+				"user text, "
+				"did_fetch int default 0);"
+				"create index if not exists idx_conversation_id on conversation(id);"
+
+				// View model of conversations
+				"create table if not exists conversation_list "
+				"(id text, "
+				"next text, "
+				"prev text, "
+				"idx int, "
+				"display_name text); "
+				"create index if not exists idx_conversation_list_id on conversation_list(id);"
+				"create index if not exists idx_conversation_list_display_name on conversation_list(display_name);"
+
+				"create table if not exists user (id text, name text);"
+				"create index if not exists idx_user_id on user(id);"
+
+				"create table if not exists message "
+				"(conversation text, "
+				 "type text, "
+				 "user text, "
+				 "text text, "
+				 "ts text, "
+				 "id integer primary key autoincrement, "
+				 "pending int default 0, "
+				 // 0 while slack hasn't replied to a sent message, -1 if it refused it
+				 "acknowledged int default 1);"
+
+				// Reaction counts, per message and emoji
+				"create table if not exists reaction "
+				"(conversation text, "
+				 "ts text, "
+				 "name text, "
+				 "count int, "
+				 "primary key (conversation, ts, name));"
+
+				// Last read message per conversation, and the last one slack knows about
+				"create table if not exists read_marker "
+				"(conversation text primary key, "
+				 "last_read text, "
+				 "synced text);"
+
+				// Chunks of a long message, each is only sent after the one before is acknowledged
+				"create table if not exists outbox "
+				"(message_id integer primary key, "
+				 "after integer);"
+				"create index if not exists idx_outbox_after on outbox(after);"
+
+				// Collapsed messages the user asked to see in full. Keyed like
+				// reaction, message ids change when history is fetched again.
+				"create table if not exists expanded_message "
+				"(conversation text, "
+				 "ts text, "
+				 "primary key (conversation, ts));"
+
+				// Split view of the message area, see struct pane
+				"create table if not exists pane "
+				"(id integer primary key, "
+				 "conversation text, "
+				 "anchor text);"
+
+				// A pane showing only what one user said, in its conversation or everywhere
+				"create table if not exists pane_filter "
+				"(pane integer primary key, "
+				 "user text, "
+				 "everywhere int);"
+				"create index if not exists idx_user_name on user(name)";
+	// expanded_message used to be keyed by message id. It's only UI
+	// state, so an old one is dropped rather than migrated.
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"with js(c) as (select json(?)) "
-				"update message "
-				"set ts = json_extract(c, '$.ts'), "
-				    "text = json_extract(c, '$.text'),"
-				    "acknowledged = 1 "
-				"from js "
-				"where id = json_extract(c, '$.reply_to') "
-				"and json_extract(c, '$.ok') == 1 "
-				, -1, &stmt, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
-	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite_check(db, prepare_statement(db, old_expanded_message_sql, -1, &stmt, NULL));
+	int v = sqlite3_step(stmt);
 	sqlite3_finalize(stmt);
+	if (v == SQLITE_ROW) {
+		sqlite_check(db, sqlite3_exec(db, "drop table expanded_message", NULL, NULL, NULL));
+	} else if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	sqlite_check(db, sqlite3_exec(db, init_script, NULL, NULL, NULL));
+	sqlite_check(db, sqlite3_exec(db, message_index_script, NULL, NULL, NULL));
+	sqlite_check(db, exec_statement(db, create_first_pane_sql));
+	sqlite_check(db, exec_statement(db, orphan_pane_filters_sql));
+
+	// An in-memory database can't be shared between connections
+	if (strlen(sqlite3_db_filename(db, "main")) == 0) {
+		read_db = db;
+	} else if (sqlite3_open_v2(path, &read_db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		fprintf(errfile, "Failed to open read connection %s", sqlite3_errmsg(read_db));
+		raise(SIGTERM);
+	}
 }
 
-static void handle_ws(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
-	if (ev == MG_EV_CONNECT) {
-		const char* url = (const char*)fn_data;
-		handle_connect(url, c);
-	} else if (ev == MG_EV_WS_MSG) {
-		struct mg_ws_message* wm = (struct mg_ws_message*)ev_data;
-		sqlite3_stmt* stmt;
-		sqlite_check(db, sqlite3_prepare_v2(db, 
-					"with js(c) as (select json(?)) "
-					"select "
-						"json_extract(c, '$.type'), "
-						"json_extract(c, '$.reply_to') "
-					"from js", -1, &stmt, NULL));
-		sqlite_check(db, sqlite3_bind_text(stmt, 1, wm->data.ptr, wm->data.len, NULL));
-		int v = sqlite3_step(stmt);
-		if (v == SQLITE_ROW) {
-			const char* type = sqlite3_column_text(stmt, 0);
-			int reply_to = sqlite3_column_int(stmt, 1);
-			if (reply_to > 0) {
-				handle_ws_reply(wm->data);
-			} else if (type != NULL) {
-				if (strcmp(type, "hello") == 0) {
-					// Remember the new websocket connection so we can send stuff
-					ws_connection = c;
-					handle_ws_hello(wm->data);
-				} else if (strcmp(type, "message") == 0) {
-					handle_ws_message(wm->data);
-				} else {
-					dbg("unhandled message type %s", type);
-				}
-			} else {
-				dbg("websocket message with no reply_to or type %.*s", wm->data.len, wm->data.ptr);
-			}
-		} else {
-			sqlite_check(db, v);
+static const char* export_conversation_id_sql =
+	"select /* full scan */ c.id "
+	"from conversation c "
+	"left join user u "
+	  "on u.id = c.user "
+	"where c.id = ?1 "
+	"or c.name = ?1 "
+	"or (c.is_im = 1 and u.name = ?1) "
+	"limit 1";
+
+/*
+ * slack-term-c --export <conversation> <file> [--since <time>] [--until <time>]
+ * The conversation is a name or id, times are like in go to mode.
+ */
+int export_from_cli(const char* conversation, const char* path,
+		const char* since, const char* until) {
+	// Names are looked up in the cache, anything else is taken as an id
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, export_conversation_id_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, conversation, -1, NULL));
+	int v = sqlite3_step(stmt);
+	if (v != SQLITE_ROW && v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	struct export* e = new_export(v == SQLITE_ROW ? (const char*)sqlite3_column_text(stmt, 0) : conversation,
+			path, since, until);
+	sqlite3_finalize(stmt);
+	if (e == NULL) {
+		fprintf(stderr, "times are yyyy-mm-dd, yyyy-mm-dd hh:mm or hh:mm\n");
+		return 2;
+	}
+	e->waited_on = true;
+	start_workers();
+	mg_mgr_init(&mgr);
+	unsigned long start = micros();
+	start_export(e);
+	while (!e->done) {
+		mg_mgr_poll(&mgr, 10);
+		run_completed_tasks();
+	}
+	stop_workers();
+	if (e->fetch_error != NULL) {
+		fprintf(stderr, "could not fetch history, exported what's cached: %s\n", e->fetch_error);
+	}
+	int status = 0;
+	if (e->error != NULL) {
+		fprintf(stderr, "export failed: %s\n", e->error);
+		status = 1;
+	} else {
+		fprintf(stderr, "exported %ld messages in %.1fs, %d pages of history fetched\n",
+				e->rows, (micros() - start) / 1e6, e->pages);
+	}
+	free_export(e);
+	return status;
+}
+
+/*
+ * A slack workspace export is a zip of users.json, channels.json,
+ * groups.json, dms.json, mpims.json and a <channel>/<yyyy-mm-dd>.json
+ * for each day of each conversation. The archive is walked through its
+ * central directory, zip64 included, with only the entry being read in
+ * memory. The small list files are loaded first so the day files can be
+ * given conversation ids. Day files are then read ahead a few per worker,
+ * and inflated and parsed on the workers, each with its own in-memory
+ * database for json_each. Their rows come back to the main thread to be
+ * inserted in transactions of IMPORT_BATCH_ROWS, with the message indexes
+ * dropped until the end.
+ */
+struct zip_entry {
+	char name[512];
+	int method;
+	sqlite3_int64 compressed_size;
+	sqlite3_int64 size;
+	sqlite3_int64 offset;
+};
+
+static unsigned int zip_u16(const unsigned char* p) {
+	return p[0] | p[1] << 8;
+}
+
+static sqlite3_int64 zip_u32(const unsigned char* p) {
+	return (sqlite3_int64)(p[0] | p[1] << 8 | p[2] << 16) | (sqlite3_int64)p[3] << 24;
+}
+
+static sqlite3_int64 zip_u64(const unsigned char* p) {
+	return zip_u32(p) | zip_u32(p + 4) << 32;
+}
+
+/*
+ * Finds the central directory from the end of central directory record,
+ * or its zip64 version. Leaves zip at the first entry.
+ */
+bool open_zip_directory(FILE* zip, sqlite3_int64* entries) {
+	unsigned char tail[65536 + 22];
+	if (fseeko(zip, 0, SEEK_END) != 0) {
+		return false;
+	}
+	off_t file_size = ftello(zip);
+	int len = MIN(file_size, (off_t)sizeof(tail));
+	if (fseeko(zip, file_size - len, SEEK_SET) != 0 || fread(tail, 1, len, zip) != len) {
+		return false;
+	}
+	int end = -1;
+	for (int i=len-22; i>=0 && end < 0; i--) {
+		if (zip_u32(&tail[i]) == 0x06054b50) {
+			end = i;
 		}
-		sqlite3_finalize(stmt);
 	}
+	if (end < 0) {
+		return false;
+	}
+	*entries = zip_u16(&tail[end + 10]);
+	sqlite3_int64 directory = zip_u32(&tail[end + 16]);
+	// Preceded by a zip64 locator when there's too much for 16 and 32 bits
+	if (end >= 20 && zip_u32(&tail[end - 20]) == 0x07064b50) {
+		unsigned char end64[56];
+		if (fseeko(zip, zip_u64(&tail[end - 12]), SEEK_SET) != 0
+				|| fread(end64, 1, 56, zip) != 56
+				|| zip_u32(end64) != 0x06064b50) {
+			return false;
+		}
+		*entries = zip_u64(&end64[32]);
+		directory = zip_u64(&end64[48]);
+	}
+	return fseeko(zip, directory, SEEK_SET) == 0;
+}
+
+// Reads the next central directory header, sizes from zip64 extras if set
+bool next_zip_entry(FILE* zip, struct zip_entry* e) {
+	unsigned char h[46];
+	if (fread(h, 1, 46, zip) != 46 || zip_u32(h) != 0x02014b50) {
+		return false;
+	}
+	e->method = zip_u16(&h[10]);
+	e->compressed_size = zip_u32(&h[20]);
+	e->size = zip_u32(&h[24]);
+	e->offset = zip_u32(&h[42]);
+	int name_len = zip_u16(&h[28]);
+	int extra_len = zip_u16(&h[30]);
+	int comment_len = zip_u16(&h[32]);
+	int kept = MIN(name_len, (int)sizeof(e->name) - 1);
+	if (fread(e->name, 1, kept, zip) != kept) {
+		return false;
+	}
+	e->name[kept] = '\0';
+	unsigned char extra[65536];
+	if (fseeko(zip, name_len - kept, SEEK_CUR) != 0
+			|| fread(extra, 1, extra_len, zip) != extra_len
+			|| fseeko(zip, comment_len, SEEK_CUR) != 0) {
+		return false;
+	}
+	for (int i=0; i+4 <= extra_len; i += 4 + zip_u16(&extra[i+2])) {
+		if (zip_u16(&extra[i]) != 0x0001) {
+			continue;
+		}
+		// Only the fields that overflowed are there, in this order
+		int j = i + 4;
+		int field_end = MIN(extra_len, j + zip_u16(&extra[i+2]));
+		if (e->size == 0xffffffff && j + 8 <= field_end) {
+			e->size = zip_u64(&extra[j]);
+			j += 8;
+		}
+		if (e->compressed_size == 0xffffffff && j + 8 <= field_end) {
+			e->compressed_size = zip_u64(&extra[j]);
+			j += 8;
+		}
+		if (e->offset == 0xffffffff && j + 8 <= field_end) {
+			e->offset = zip_u64(&extra[j]);
+		}
+	}
+	return true;
+}
+
+// Sizes come straight from the archive
+bool zip_entry_fits(struct zip_entry* e) {
+	return e->compressed_size >= 0 && e->compressed_size <= ZIP_ENTRY_MAX
+		&& e->size >= 0 && e->size <= ZIP_ENTRY_MAX;
+}
+
+// The compressed bytes of an entry, NULL if it's too big. Caller frees
+unsigned char* read_zip_entry(FILE* zip, struct zip_entry* e) {
+	unsigned char h[30];
+	if (!zip_entry_fits(e)
+			|| fseeko(zip, e->offset, SEEK_SET) != 0
+			|| fread(h, 1, 30, zip) != 30
+			|| zip_u32(h) != 0x04034b50
+			|| fseeko(zip, zip_u16(&h[26]) + zip_u16(&h[28]), SEEK_CUR) != 0) {
+		return NULL;
+	}
+	unsigned char* data = malloc(MAX(e->compressed_size, 1));
+	if (data == NULL || fread(data, 1, e->compressed_size, zip) != e->compressed_size) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+// Stored or deflated entries only, NUL terminated. Caller frees
+char* inflate_zip_entry(struct zip_entry* e, const unsigned char* data) {
+	char* text = zip_entry_fits(e) ? malloc(e->size + 1) : NULL;
+	if (text == NULL) {
+		return NULL;
+	} else if (e->method == 0 && e->compressed_size == e->size) {
+		memcpy(text, data, e->size);
+	} else if (e->method == 8) {
+		z_stream z = {0};
+		z.next_in = (unsigned char*)data;
+		z.avail_in = e->compressed_size;
+		z.next_out = (unsigned char*)text;
+		z.avail_out = e->size;
+		// Raw deflate, zip has its own headers
+		bool ok = inflateInit2(&z, -MAX_WBITS) == Z_OK
+			&& inflate(&z, Z_FINISH) == Z_STREAM_END
+			&& z.total_out == e->size;
+		inflateEnd(&z);
+		if (!ok) {
+			free(text);
+			return NULL;
+		}
+	} else {
+		free(text);
+		return NULL;
+	}
+	text[e->size] = '\0';
+	return text;
+}
+
+/*
+ * Rows parsed on a worker, packed one field after another. Each field is a
+ * 0 byte for NULL, or a 1 byte and NUL terminated text.
+ */
+struct import_rows {
+	int len;
+	char* data;
+	size_t used;
+	size_t size;
+};
+
+void add_import_field(struct import_rows* r, const char* text) {
+	size_t len = text != NULL ? strlen(text) + 2 : 1;
+	if (r->used + len > r->size) {
+		r->size = MAX(r->size * 2, r->used + len + 4096);
+		r->data = realloc(r->data, r->size);
+	}
+	r->data[r->used++] = text != NULL;
+	if (text != NULL) {
+		memcpy(&r->data[r->used], text, len - 1);
+		r->used += len - 1;
+	}
+}
+
+// Binds the next columns fields at *pos to stmt, from parameter first
+void bind_import_fields(sqlite3_stmt* stmt, int first, struct import_rows* r, size_t* pos, int columns) {
+	for (int i=first; i<first+columns; i++) {
+		if (r->data[(*pos)++] == 0) {
+			sqlite_check(db, sqlite3_bind_null(stmt, i));
+			continue;
+		}
+		const char* text = &r->data[*pos];
+		size_t len = strlen(text);
+		sqlite_check(db, sqlite3_bind_text(stmt, i, text, len, NULL));
+		*pos += len + 1;
+	}
+}
+
+struct import_file {
+	struct zip_entry entry;
+	char* conversation;
+	unsigned char* data;
+	// Filled in on the worker
+	struct import_rows messages;
+	struct import_rows reactions;
+	char* error;
+};
+
+/*
+ * Workers parse with a connection of their own, kept in a pool between
+ * files since opening one and preparing its statements costs about as
+ * much as parsing a day. Statements are prepared with sqlite3_prepare_v2
+ * like write_export, the checks in prepare_statement are main thread only,
+ * --check-query-plans <db> checks them from statement_table instead.
+ */
+struct import_parser {
+	sqlite3* db;
+	sqlite3_stmt* messages;
+	sqlite3_stmt* reactions;
+	struct import_parser* next;
+};
+
+struct import_parser* idle_parsers;
+pthread_mutex_t idle_parsers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void close_import_parser(struct import_parser* p) {
+	sqlite3_finalize(p->messages);
+	sqlite3_finalize(p->reactions);
+	sqlite3_close(p->db);
+	free(p);
+}
+
+static const char* parse_messages_sql =
+	"select "
+		"json_extract(value, '$.type'), "
+		"json_extract(value, '$.user'), "
+		"json_extract(value, '$.text'), "
+		"json_extract(value, '$.ts'), "
+		"json_extract(value, '$.reactions') "
+	"from json_each(?)";
+static const char* parse_reactions_sql =
+	"select "
+		"json_extract(value, '$.name'), "
+		"json_extract(value, '$.count') "
+	"from json_each(?)";
+
+// NULL if sqlite can't be opened
+struct import_parser* take_import_parser() {
+	pthread_mutex_lock(&idle_parsers_lock);
+	struct import_parser* p = idle_parsers;
+	if (p != NULL) {
+		idle_parsers = p->next;
+	}
+	pthread_mutex_unlock(&idle_parsers_lock);
+	if (p != NULL) {
+		return p;
+	}
+	p = calloc(1, sizeof(struct import_parser));
+	// A message's reactions come back as json, only those are parsed again
+	if (sqlite3_open(":memory:", &p->db) != SQLITE_OK
+			|| sqlite3_prepare_v2(p->db, parse_messages_sql, -1, &p->messages, NULL) != SQLITE_OK
+			|| sqlite3_prepare_v2(p->db, parse_reactions_sql, -1, &p->reactions, NULL) != SQLITE_OK) {
+		close_import_parser(p);
+		return NULL;
+	}
+	return p;
 }
 
-static void handle_rtm_connect(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
-	if (ev == MG_EV_CONNECT) {
-		handle_connect(slack_rtm_connect_url ,c);
-	} else if (ev == MG_EV_HTTP_MSG) {
-		struct mg_http_message *hm = (struct mg_http_message *) ev_data;
-		struct mg_str payload = hm->body;
-		sqlite3_stmt* stmt;
-		sqlite_check(db, sqlite3_prepare_v2(db, 
-					"with js(c) as (select json(?)) "
-					"select json_extract(c, '$.url'), "
-						"json_extract(c, '$.self.id') "
-					"from js"
-					, -1, &stmt, NULL));
-		sqlite_check(db, sqlite3_bind_text(stmt, 1, payload.ptr, payload.len, NULL));
-		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
-		const char* wss_url = sqlite3_column_text(stmt, 0);
-		const char* current_user_id = sqlite3_column_text(stmt, 1);
-		// Need to take a copy of the dynamic URL for the connect method later
-		mg_ws_connect(&mgr, wss_url, handle_ws, (void*)strdup(wss_url), NULL);
-		set_current_user_id(current_user_id);
-		c->is_closing = 1;
-	} 
+void release_import_parser(struct import_parser* p) {
+	sqlite3_reset(p->messages);
+	sqlite3_reset(p->reactions);
+	pthread_mutex_lock(&idle_parsers_lock);
+	p->next = idle_parsers;
+	idle_parsers = p;
+	pthread_mutex_unlock(&idle_parsers_lock);
 }
 
-void cleanup() {
-	mg_mgr_free(&mgr);
-	tb_shutdown();
-	fclose(errfile);
-	fclose(dbgfile);
-	sqlite3_close(db);
+void close_idle_parsers() {
+	while (idle_parsers != NULL) {
+		struct import_parser* next = idle_parsers->next;
+		close_import_parser(idle_parsers);
+		idle_parsers = next;
+	}
 }
 
-static volatile sig_atomic_t sigint_in_progress = 0;
-void handle_term(int sig) {
-	if (sigint_in_progress) {
-		raise(sig);
-		return;
+// Into messages and reactions, SQLITE_DONE once the whole file is read
+int parse_import_json(struct import_parser* p, const char* json, int len, struct import_file* f) {
+	sqlite3_bind_text(p->messages, 1, json, len, NULL);
+	int v;
+	for (v = sqlite3_step(p->messages); v == SQLITE_ROW; v = sqlite3_step(p->messages)) {
+		for (int i=0; i<4; i++) {
+			add_import_field(&f->messages, sqlite3_column_text(p->messages, i));
+		}
+		f->messages.len++;
+		const char* reactions = sqlite3_column_text(p->messages, 4);
+		if (reactions == NULL) {
+			continue;
+		}
+		sqlite3_reset(p->reactions);
+		sqlite3_bind_text(p->reactions, 1, reactions, -1, NULL);
+		int r;
+		for (r = sqlite3_step(p->reactions); r == SQLITE_ROW; r = sqlite3_step(p->reactions)) {
+			add_import_field(&f->reactions, sqlite3_column_text(p->messages, 3));
+			add_import_field(&f->reactions, sqlite3_column_text(p->reactions, 0));
+			add_import_field(&f->reactions, sqlite3_column_text(p->reactions, 1));
+			f->reactions.len++;
+		}
+		if (r != SQLITE_DONE) {
+			return r;
+		}
 	}
-	sigint_in_progress = 1;
-	cleanup();
-	signal(sig, SIG_DFL);
-	raise(sig);
+	return v;
 }
 
-void update_hook(void* user_data, 
-		int operation, 
-		const char* database, 
-		const char* tablename, 
-		sqlite3_int64 rowid) {
-	struct state_update* u = database_update(database,
-			operation, 
-			tablename, 
-			rowid);
-	list_append(&state_update_queue, u);
+// Runs on a worker
+void parse_import_file(void* arg) {
+	struct import_file* f = arg;
+	char* json = inflate_zip_entry(&f->entry, f->data);
+	free(f->data);
+	f->data = NULL;
+	struct import_parser* p = json != NULL ? take_import_parser() : NULL;
+	if (json == NULL) {
+		f->error = strdup("could not inflate");
+	} else if (p == NULL) {
+		f->error = strdup("could not open sqlite");
+	} else {
+		if (parse_import_json(p, json, f->entry.size, f) != SQLITE_DONE) {
+			f->error = strdup(sqlite3_errmsg(p->db));
+			// A file is imported whole or not at all
+			f->messages.len = 0;
+			f->reactions.len = 0;
+		}
+		release_import_parser(p);
+	}
+	free(json);
 }
 
-static void handle_conversation_history(struct mg_connection* c, int ev, void* ev_data, void* fn_data) {
-	char* selected_conversation_id = fn_data;
-	if (ev == MG_EV_CONNECT) {
-		char* url = format_url1(slack_conversation_history_url, selected_conversation_id);
-		handle_connect(url, c);
-		free(url);
-	} else if (ev == MG_EV_HTTP_MSG) {
-		struct mg_http_message* hm = ev_data;
-		dbg("handing conversation history %.*s", hm->body.len, hm->body.ptr);
+struct import {
+	sqlite3_stmt* insert_message;
+	sqlite3_stmt* insert_reaction;
+	long files;
+	long skipped;
+	long messages;
+	long reactions;
+	long uncommitted;
+	unsigned long start;
+	unsigned long last_report;
+};
 
-		sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
-		sqlite3_stmt* stmt;
-		sqlite_check(db, sqlite3_prepare_v2(db, "delete from message where conversation = ?", -1, &stmt, NULL));	
-		sqlite_check(db, sqlite3_bind_text(stmt, 1, selected_conversation_id, -1, NULL));
-		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
-		sqlite3_finalize(stmt);
+struct import import;
 
-		sqlite_check(db, sqlite3_prepare_v2(db, 
-					"insert into message "
-					"(conversation, type, user, text, ts) "
-					"select "
-						"?, "
-						"json_extract(value, '$.type'), "
-						"json_extract(value, '$.user'), "
-						"json_extract(value, '$.text'), "
-						"json_extract(value, '$.ts') "
-					"from json_each(?, '$.messages')", -1, &stmt, NULL));
-		sqlite_check(db, sqlite3_bind_text(stmt, 1, selected_conversation_id, -1, NULL));
-		sqlite_check(db, sqlite3_bind_text(stmt, 2, hm->body.ptr, hm->body.len, NULL));
-		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
-		sqlite3_finalize(stmt);
-		sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
-		c->is_closing = true;
-		free(selected_conversation_id);
-	} else if (ev == MG_EV_ERROR) {
-		char* error_message = ev_data;
-		dbg("Error fetching conversation history %s", error_message);
-		c->is_closing = true;
-		free(selected_conversation_id);
-	}
+void report_import(const char* stage) {
+	double s = (micros() - import.start) / 1e6;
+	long rows = import.messages + import.reactions;
+	fprintf(stderr, "\r%s %ld files, %ld messages, %ld reactions in %.1fs, %.0f rows/s   ", stage,
+			import.files, import.messages, import.reactions, s, s > 0 ? rows / s : 0);
 }
 
-bool did_key_change(struct state_update* u, const char* expected_key) {
-	if (strcmp(u->tablename, "kvs") != 0) {
-		return false;
+// Back on the main thread, the parsed rows go into the open transaction
+void store_import_file(void* arg) {
+	struct import_file* f = arg;
+	if (f->error != NULL) {
+		dbg("skipped %s: %s", f->entry.name, f->error);
+		import.skipped++;
 	}
-	char* key = get_key_value_key_by_rowid(u->rowid);
-	bool changed = key != NULL && strcmp(key, expected_key) == 0;
-	free(key);
-	return changed;
+	size_t pos = 0;
+	for (int i=0; i<f->messages.len; i++) {
+		sqlite3_reset(import.insert_message);
+		sqlite_check(db, sqlite3_bind_text(import.insert_message, 1, f->conversation, -1, NULL));
+		bind_import_fields(import.insert_message, 2, &f->messages, &pos, 4);
+		sqlite_check_ex(db, sqlite3_step(import.insert_message), SQLITE_DONE);
+	}
+	pos = 0;
+	for (int i=0; i<f->reactions.len; i++) {
+		sqlite3_reset(import.insert_reaction);
+		sqlite_check(db, sqlite3_bind_text(import.insert_reaction, 1, f->conversation, -1, NULL));
+		bind_import_fields(import.insert_reaction, 2, &f->reactions, &pos, 3);
+		sqlite_check_ex(db, sqlite3_step(import.insert_reaction), SQLITE_DONE);
+	}
+	import.files++;
+	import.messages += f->messages.len;
+	import.reactions += f->reactions.len;
+	import.uncommitted += f->messages.len + f->reactions.len;
+	if (import.uncommitted >= IMPORT_BATCH_ROWS) {
+		sqlite_check(db, sqlite3_exec(db, "commit; begin", NULL, NULL, NULL));
+		import.uncommitted = 0;
+	}
+	if (micros() - import.last_report > 1000000) {
+		import.last_report = micros();
+		report_import("importing");
+	}
+	free(f->conversation);
+	free(f->messages.data);
+	free(f->reactions.data);
+	free(f->error);
+	free(f);
 }
 
-// Build up the conversations list for left hand panel
-// If the conversation table changes, or the search input buffer
-void update_conversations_list(struct state_update* u) {
-	if (!did_key_change(u, "search_input_buffer")
-	  && strcmp(u->tablename, "conversation") != 0) {
-		return;
-	}
-	sqlite_check(db, sqlite3_exec(db, 
-		"delete from conversation_list", NULL, NULL, NULL));
-	list_t* sb = get_input_buffer(search_input_buffer);
-	if (list_size(sb) > 0) {
-		sqlite3_str* str = sqlite3_str_new(db);
-		char* sc = to_char_array(sb);
-		sqlite3_str_appendall(str, sc);
-		sqlite3_str_appendchar(str, 1, '%');
-		char* p = sqlite3_str_finish(str);
-		free(sc);
-		sqlite3_stmt* stmt;
-		sqlite_check(db, sqlite3_prepare_v2(db, 
-			"insert into conversation_list (id, next, prev, idx, display_name) "
-			"with tmp(id, display_name, is_member, is_im) as ("
-				"select c.id, "
-					"case when is_im = 1 then ifnull(u.name, 'Unknown user!') else c.name end as display_name, "
-					"c.is_member, "
-					"c.is_im "
-				"from conversation c "
-				"left outer join user u on u.id = c.user "
-			")"
-			"select id, "
-				"lead(id, 1) over win, "
-				"lag(id, 1) over win, "
-				"(row_number() over win) - 1, "
-				"display_name "
-			"from tmp "
-			"where (is_member = 1 or is_im = 1) "
-			"and display_name like ? "
-			"window win as (order by display_name) "
-			, -1, &stmt, NULL));
-		sqlite_check(db, sqlite3_bind_text(stmt, 1, p, -1, NULL));
-		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
-		sqlite3_free(p);
-		sqlite3_finalize(stmt);
-	} else {
-		sqlite_check(db, sqlite3_exec(db, 
-			"insert into conversation_list (id, next, prev, idx, display_name) "
-			"with tmp(id, display_name, is_member, is_im) as ("
-				"select c.id, "
-					"case when is_im = 1 then ifnull(u.name, 'Unknown user!') else c.name end as display_name, "
-					"c.is_member, "
-					"c.is_im "
-				"from conversation c "
-				"left outer join user u on u.id = c.user "
-			")"
-			"select id, "
-				"lead(id, 1) over win, "
-				"lag(id, 1) over win, "
-				"(row_number() over win) - 1, "
-				"display_name "
-			"from tmp "
-			"where (is_member = 1 or is_im = 1) "
-			"window win as (order by display_name) "
-			, NULL, NULL, NULL));
-	}
-	list_destroy(sb);
-	
+bool is_list_file(const char* file) {
+	return strcmp(file, "users.json") == 0 || strcmp(file, "channels.json") == 0
+		|| strcmp(file, "groups.json") == 0 || strcmp(file, "dms.json") == 0
+		|| strcmp(file, "mpims.json") == 0;
 }
 
-void fetch_selected_conversation(struct state_update* u) {
-	if (!did_key_change(u, "selected_conversation")) {
-		return;
+static const char* import_users_sql =
+	"insert into user "
+	"(id, name) "
+	"select "
+		"json_extract(value, '$.id'), "
+		"json_extract(value, '$.name') "
+	"from json_each(?) "
+	"where not exists ("
+		"select 1 from user u "
+		"where u.id = json_extract(value, '$.id'))";
+
+static const char* import_conversations_sql =
+	"insert into conversation "
+	"(id, name, is_member, is_im, user) "
+	"select "
+		"json_extract(c.value, '$.id'), "
+		"json_extract(c.value, '$.name'), "
+		"1, "
+		"?2, "
+		"case when ?2 and ?3 is not null then ("
+			"select m.value from json_each(c.value, '$.members') m "
+			"where m.value is not ?3 "
+			"limit 1) end "
+	"from json_each(?1) c "
+	"where not exists ("
+		"select 1 from conversation old "
+		"where old.id = json_extract(c.value, '$.id'))";
+
+// The members of the first dm who are in every dm
+static const char* import_self_sql =
+	"select m.value from json_each(?1, '$[0].members') m "
+	"where not exists ("
+		"select 1 from json_each(?1) c "
+		"where not exists ("
+			"select 1 from json_each(c.value, '$.members') o "
+			"where o.value = m.value))";
+
+/*
+ * Whoever exported the workspace is in every dm of dms.json. Into a fresh
+ * slack.db there's no current user to tell them apart from the other
+ * member, so they're found as the only one in all of them. NULL if that's
+ * not one user, like with a single dm. Caller frees.
+ */
+char* import_self_id(const char* json) {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, import_self_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, json, -1, NULL));
+	char* res = NULL;
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		res = strdup(sqlite3_column_text(stmt, 0));
+		v = sqlite3_step(stmt);
 	}
-	const char* selected_conversation_id = get_selected_conversation();
-	if  (get_conversation_did_fetch(selected_conversation_id)) {
-		free((void*)selected_conversation_id);
-		return;
+	if (v == SQLITE_ROW) {
+		free(res);
+		res = NULL;
+	} else if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
 	}
-	char* url = format_url1(slack_conversation_history_url, selected_conversation_id);
-	mg_http_connect(&mgr, url, handle_conversation_history, (void*)selected_conversation_id);
-	set_conversation_did_fetch(selected_conversation_id, true);
-	free(url);
+	sqlite3_finalize(stmt);
+	return res;
 }
 
-void reset_search(struct state_update* u) {
-	if (!did_key_change(u, "mode")) {
+static const char* import_channels_sql =
+	"insert or replace into import_channel "
+	"(name, id) "
+	"select "
+		"ifnull(json_extract(value, '$.name'), json_extract(value, '$.id')), "
+		"json_extract(value, '$.id') "
+	"from json_each(?)";
+
+/*
+ * Loads one of the list files. Conversations get a row in import_channel
+ * under the name their day files are kept under, the id for dms.
+ */
+void import_list_file(const char* file, const char* json) {
+	sqlite3_stmt* stmt;
+	if (strcmp(file, "users.json") == 0) {
+		sqlite_check(db, prepare_statement(db, import_users_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_text(stmt, 1, json, -1, NULL));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
 		return;
 	}
-	if (get_current_mode() == mode_search) {
-		list_t lst;
-		list_init(&lst);
-		set_input_buffer(&lst, search_input_buffer);
-		set_input_cursor_pos(0, search_input_buffer);
+	bool is_im = strcmp(file, "dms.json") == 0;
+	char* current_user_id = get_current_user_id();
+	if (is_im && current_user_id == NULL) {
+		current_user_id = import_self_id(json);
 	}
+	// Without it a dm's user is left NULL rather than maybe being yourself
+	sqlite_check(db, prepare_statement(db, import_conversations_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, json, -1, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 2, is_im));
+	sqlite_check(db, sqlite3_bind_text(stmt, 3, current_user_id, -1, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
+	free(current_user_id);
+	sqlite_check(db, prepare_statement(db, import_channels_sql, -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, json, -1, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_finalize(stmt);
 }
 
-void select_only_conversation(struct state_update* u) {
-	if (strcmp(u->tablename, "conversation_list") != 0) {
-		return;
+/*
+ * The file name, and into dir the directory it's in, empty if it's at the
+ * top. Exports are sometimes zipped with a folder around them.
+ */
+const char* split_zip_name(const char* name, char* dir, int len) {
+	const char* file = strrchr(name, '/');
+	dir[0] = '\0';
+	if (file == NULL) {
+		return name;
 	}
-	if (count_conversations() == 1) {
-		select_first_conversation();
+	const char* parent = file;
+	while (parent > name && parent[-1] != '/') {
+		parent--;
 	}
+	snprintf(dir, len, "%.*s", (int)(file - parent), parent);
+	return file + 1;
 }
 
-bool process_state_update_queue() {
-	bool did_process = false;
-	for (struct state_update* u = list_extract_at(&state_update_queue, 0);
-			u != NULL;
-			u = list_extract_at(&state_update_queue, 0)) {
-		did_process = true;
-		for (int i=0; i<list_size(&state_listeners); i++) {
-			void (*fn)(struct state_update*) = list_get_at(&state_listeners,i);
-			fn(u);
+bool is_day_file(const char* file) {
+	int year, month, day;
+	char rest[8];
+	return sscanf(file, "%4d-%2d-%2d%7s", &year, &month, &day, rest) == 4
+		&& strcmp(rest, ".json") == 0;
+}
+
+static const char* max_message_id_sql =
+	"select ifnull(max(id), 0) from message";
+
+static const char* import_channel_id_sql =
+	"select ifnull((select id from import_channel where name = ?1), ?1)";
+
+static const char* import_message_sql =
+	"insert into message "
+	"(conversation, type, user, text, ts) "
+	"values (?, ?, ?, ?, ?)";
+
+static const char* import_reaction_sql =
+	"insert or ignore into reaction "
+	"(conversation, ts, name, count) "
+	"values (?, ?, ?, ?)";
+
+static const char* import_dedupe_sql =
+	"delete from message "
+	"where id > ? "
+	"and exists ("
+		"select 1 from message old "
+		"where old.conversation = message.conversation "
+		"and old.ts = message.ts "
+		"and old.id < message.id)";
+// Conversation ids by name, for the day files
+static const char* create_import_channel_sql =
+	"create temp table import_channel (name text primary key, id text)";
+
+/*
+ * slack-term-c --import <export.zip>
+ * Messages already in slack.db are kept, and imported copies of them are
+ * deleted once there's an index to find them with.
+ */
+int import_from_cli(const char* path) {
+	FILE* dir = fopen(path, "rb");
+	FILE* data = fopen(path, "rb");
+	sqlite3_int64 entries;
+	if (dir == NULL || data == NULL || !open_zip_directory(dir, &entries)) {
+		fprintf(stderr, "%s isn't a zip file\n", path);
+		if (dir != NULL) {
+			fclose(dir);
 		}
-		free_state_update(u);
+		if (data != NULL) {
+			fclose(data);
+		}
+		return 1;
 	}
-	return did_process;
-}
+	off_t directory = ftello(dir);
+	import = (struct import){.start = micros()};
+	sqlite_check(db, sqlite3_exec(db,
+				"pragma synchronous = off;"
+				"pragma cache_size = -65536", NULL, NULL, NULL));
+	sqlite_check(db, sqlite3_exec(db, create_import_channel_sql, NULL, NULL, NULL));
 
-void init_database() {
-	if (sqlite3_open(DB_PATH, &db) != SQLITE_OK) {
-		fprintf(errfile, "Failed to open database %s", sqlite3_errmsg(db));
-		raise(SIGTERM);
+	// The lists first, day files are named after the conversations
+	sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
+	struct zip_entry e;
+	for (sqlite3_int64 i=0; i<entries && next_zip_entry(dir, &e); i++) {
+		char parent[256];
+		const char* file = split_zip_name(e.name, parent, 256);
+		if (!is_list_file(file)) {
+			continue;
+		}
+		unsigned char* compressed = read_zip_entry(data, &e);
+		char* json = compressed != NULL ? inflate_zip_entry(&e, compressed) : NULL;
+		if (json != NULL) {
+			import_list_file(file, json);
+		} else {
+			fprintf(stderr, "could not read %s\n", file);
+		}
+		free(compressed);
+		free(json);
 	}
-	const char* init_script =
-				// Generic key-value store! Don't specify a datatype
-				"create table if not exists kvs (key text primary key, value);"
+	sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
 
-				// Conversations
-				"create table if not exists conversation "
-				"(id text, "
-				"name text, "
-				"is_member int, "
-				"is_im int, "
-				"user text, "
-				"did_fetch int default 0);"
-				"create index if not exists idx_conversation_id on conversation(id);"
+	sqlite3_stmt* stmt;
+	sqlite_check(db, prepare_statement(db, max_message_id_sql, -1, &stmt, NULL));
+	sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_ROW);
+	sqlite3_int64 last_id = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	sqlite3_stmt* channel;
+	sqlite_check(db, prepare_statement(db, import_channel_id_sql, -1, &channel, NULL));
+	sqlite_check(db, prepare_statement(db, import_message_sql, -1, &import.insert_message, NULL));
+	sqlite_check(db, prepare_statement(db, import_reaction_sql, -1, &import.insert_reaction, NULL));
+	sqlite_check(db, sqlite3_exec(db, drop_message_index_script, NULL, NULL, NULL));
+	sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
 
-				// View model of conversations
-				"create table if not exists conversation_list "
-				"(id text, "
-				"next text, "
-				"prev text, "
-				"idx int, "
-				"display_name text); "
-				"create index if not exists idx_conversation_list_id on conversation_list(id);"
+	// Then the day files, read ahead only as far as the workers can keep up
+	start_workers();
+	int read_ahead = MAX(workers_len, 1) * IMPORT_FILES_PER_WORKER;
+	fseeko(dir, directory, SEEK_SET);
+	for (sqlite3_int64 i=0; i<entries && next_zip_entry(dir, &e); i++) {
+		char parent[256];
+		const char* file = split_zip_name(e.name, parent, 256);
+		if (parent[0] == '\0' || !is_day_file(file)) {
+			continue;
+		}
+		unsigned char* compressed = read_zip_entry(data, &e);
+		if (compressed == NULL) {
+			dbg("could not read %s", e.name);
+			import.skipped++;
+			continue;
+		}
+		struct import_file* f = calloc(1, sizeof(struct import_file));
+		f->entry = e;
+		f->data = compressed;
+		sqlite3_reset(channel);
+		sqlite_check(db, sqlite3_bind_text(channel, 1, parent, -1, NULL));
+		sqlite_check_ex(db, sqlite3_step(channel), SQLITE_ROW);
+		f->conversation = strdup(sqlite3_column_text(channel, 0));
+		while (tasks_in_flight >= read_ahead) {
+			if (!run_completed_tasks()) {
+				usleep(100);
+			}
+		}
+		submit_task(parse_import_file, store_import_file, f);
+		run_completed_tasks();
+	}
+	while (tasks_in_flight > 0) {
+		if (!run_completed_tasks()) {
+			usleep(100);
+		}
+	}
+	stop_workers();
+	close_idle_parsers();
+	sqlite3_finalize(channel);
+	sqlite3_finalize(import.insert_message);
+	sqlite3_finalize(import.insert_reaction);
+	sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
+	report_import("imported");
+	fprintf(stderr, "\n");
 
-				"create table if not exists user (id text, name text);"
+	// The index sorts can use the cores the parsing did
+	unsigned long indexing = micros();
+	sqlite3_limit(db, SQLITE_LIMIT_WORKER_THREADS, workers_len);
+	if (last_id > 0) {
+		// Only the index the check needs is there while duplicates are deleted
+		sqlite_check(db, sqlite3_exec(db,
+					"create index if not exists idx_message_conversation_ts on message(conversation, ts)",
+					NULL, NULL, NULL));
+		sqlite_check(db, prepare_statement(db, import_dedupe_sql, -1, &stmt, NULL));
+		sqlite_check(db, sqlite3_bind_int64(stmt, 1, last_id));
+		sqlite_check_ex(db, sqlite3_step(stmt), SQLITE_DONE);
+		sqlite3_finalize(stmt);
+	}
+	sqlite_check(db, sqlite3_exec(db, message_index_script, NULL, NULL, NULL));
+	sqlite_check(db, sqlite3_exec(db,
+				"drop table import_channel;"
+				"pragma synchronous = normal", NULL, NULL, NULL));
+	// Nothing is listening for updates here, so the list is rebuilt by hand
+	update_conversations_list(&(struct state_update){.tablename = "conversation"});
+	fprintf(stderr, "indexed in %.1fs", (micros() - indexing) / 1e6);
+	if (import.skipped > 0) {
+		fprintf(stderr, ", %ld files skipped, see dbg.log", import.skipped);
+	}
+	fprintf(stderr, "\n");
+	fclose(dir);
+	fclose(data);
+	return 0;
+}
 
-				"create table if not exists message "
-				"(conversation text, "
-				 "type text, "
-				 "user text, "
-				 "text text, "
-				 "ts text, "
-				 "id integer primary key autoincrement, "
-				 "pending int default 0, "
-				 "acknowledged int default 1)";
-	sqlite_check(db, sqlite3_exec(db, init_script, NULL, NULL, NULL));
+/*
+ * Every statement the app prepares or runs with exec_statement, so
+ * --check-query-plans <db> can check all their plans without waiting for
+ * each one to come up in a session.
+ */
+const char** statement_table[] = {
+	&set_key_value_sql, &get_key_value_sql, &get_key_by_rowid_sql,
+	&count_conversations_sql, &conversation_selection_pos_sql,
+	&first_conversation_sql, &next_conversation_sql,
+	&prev_conversation_sql, &get_did_fetch_sql, &set_did_fetch_sql,
+	&message_text_sql, &prefetch_layouts_sql, &typing_user_name_sql,
+	&unread_cursors_sql, &load_panes_sql, &conversation_name_sql,
+	&user_name_sql, &conversation_list_page_sql, &expand_message_sql,
+	&collapse_messages_sql, &expanded_conversation_sql,
+	&old_expanded_message_sql, &pane_conversation_sql, &toggle_unreads_sql,
+	&next_unread_sql, &next_user_message_everywhere_sql,
+	&next_user_message_sql, &read_pane_sql, &set_pane_anchor_sql,
+	&split_pane_sql, &delete_pane_sql, &previous_pane_sql, &next_pane_sql,
+	&scroll_older_sql, &scroll_newer_sql, &unsent_messages_sql,
+	&mark_message_sent_sql, &insert_message_sql, &insert_outbox_sql,
+	&clear_pane_filter_sql, &set_pane_filter_sql, &reset_pane_anchor_sql,
+	&conversation_max_rowid_sql, &insert_conversations_sql,
+	&delete_old_conversations_sql, &seed_read_markers_sql,
+	&delete_users_sql, &insert_users_sql,
+	&ws_message_sql, &ws_presence_sql, &ws_typing_sql,
+	&ws_reaction_added_sql, &ws_reaction_removed_sql,
+	&ws_reaction_cleanup_sql, &ws_marked_sql, &ws_reply_sql,
+	&ws_reply_failed_sql, &ws_reply_failed_outbox_sql, &ws_reply_outbox_sql,
+	&ws_reply_error_sql, &resend_unacknowledged_sql, &ws_type_sql,
+	&rtm_connect_sql,
+	&store_history_messages_sql, &store_history_edits_sql,
+	&clear_history_reactions_sql, &store_history_reactions_sql,
+	&export_jsonl_sql, &export_text_sql, &history_page_meta_sql,
+	&mark_synced_sql, &unsynced_marker_sql, &mark_read_sql,
+	&active_pane_following_sql,
+	&search_conversation_list_sql, &clear_conversation_list_sql,
+	&fill_conversation_list_sql, &message_conversation_sql,
+	&reaction_conversation_sql, &follow_selection_sql, &oldest_cached_sql,
+	&seek_messages_sql, &seek_user_messages_sql,
+	&seek_user_messages_everywhere_sql, &seek_anchor_sql, &reset_fetch_state_sql,
+	&create_first_pane_sql, &orphan_pane_filters_sql,
+	&export_conversation_id_sql, &parse_messages_sql, &parse_reactions_sql,
+	&import_users_sql, &import_conversations_sql, &import_self_sql,
+	&import_channels_sql, &max_message_id_sql, &import_channel_id_sql,
+	&import_message_sql, &import_reaction_sql, &import_dedupe_sql,
+	&cursor_sql[cursor_conversation], &cursor_sql[cursor_conversation_user],
+	&cursor_sql[cursor_user],
+	&user_completions.select_sql, &user_completions.select_one_sql,
+	&channel_completions.select_sql, &channel_completions.select_one_sql,
+};
+int statement_table_len = sizeof(statement_table) / sizeof(statement_table[0]);
+
+/*
+ * slack-term-c --check-query-plans <db>
+ * Nothing is run, statements are only prepared against db's schema
+ */
+int check_statement_table() {
+	sqlite_check(db, sqlite3_exec(db, create_import_channel_sql, NULL, NULL, NULL));
+	for (int i=0; i<statement_table_len; i++) {
+		check_script(db, *statement_table[i]);
+	}
+	return report_query_plans();
 }
 
 int main(int argc, const char** argv) {
@@ -1384,56 +6520,167 @@ int main(int argc, const char** argv) {
 	signal(SIGINT, handle_term);
 	signal(SIGTERM, handle_term);
 
+	const char* export_conversation = NULL;
+	const char* export_path = NULL;
+	const char* export_since = NULL;
+	const char* export_until = NULL;
+	const char* import_path = NULL;
+	const char* check_path = NULL;
+	for (int i=1; i<argc; i++) {
+		// With a database, check every statement in statement_table and
+		// exit. Without, check the plan of every statement prepared during
+		// this run, and report any that scan whole tables on exit.
+		if (strcmp(argv[i], "--check-query-plans") == 0
+				&& i + 1 < argc && argv[i + 1][0] != '-') {
+			check_path = argv[++i];
+		} else if (strcmp(argv[i], "--check-query-plans") == 0) {
+			check_query_plans = true;
+		} else if (strcmp(argv[i], "--export") == 0 && i + 2 < argc) {
+			export_conversation = argv[++i];
+			export_path = argv[++i];
+		} else if (strcmp(argv[i], "--since") == 0 && i + 1 < argc) {
+			export_since = argv[++i];
+		} else if (strcmp(argv[i], "--until") == 0 && i + 1 < argc) {
+			export_until = argv[++i];
+		} else if (strcmp(argv[i], "--import") == 0 && i + 1 < argc) {
+			import_path = argv[++i];
+		}
+	}
+	list_init(&checked_queries);
+	list_init(&query_plan_violations);
+
 	// Setup sqlite
-	init_database();
+	init_database(check_path != NULL ? check_path : DB_PATH);
+	if (check_path != NULL) {
+		int status = check_statement_table();
+		cleanup();
+		return status;
+	}
 
 	// Initialize the processing queue
 	list_init(&state_update_queue);
+	list_init(&input_update_queue);
 	list_init(&state_listeners);
 
+	if (import_path != NULL || export_conversation != NULL) {
+		int status = import_path != NULL
+			? import_from_cli(import_path)
+			: export_from_cli(export_conversation, export_path, export_since, export_until);
+		cleanup();
+		if (check_query_plans) {
+			return MAX(report_query_plans(), status);
+		}
+		return status;
+	}
+
 	// Register state_listeners
 	list_append(&state_listeners, fetch_selected_conversation);
 	list_append(&state_listeners, send_pending_messages);
 	list_append(&state_listeners, update_conversations_list);
 	list_append(&state_listeners, reset_search);
 	list_append(&state_listeners, select_only_conversation);
+	list_append(&state_listeners, update_completion_indexes);
+	list_append(&state_listeners, invalidate_layouts);
+	list_append(&state_listeners, mark_panes_dirty);
+	list_append(&state_listeners, follow_selection);
+	list_append(&state_listeners, mark_selected_read);
 
 	// Install update hook
 	sqlite3_update_hook(db, update_hook, NULL);
 
 	// Setup termbox
 	tb_init();
+	terminal_started = true;
 	tb_clear();
-	tb_set_clear_attributes(232, 255);
+	tb_set_clear_attributes(CLEAR_FG, CLEAR_BG);
 	tb_present();
-	tb_select_input_mode(TB_INPUT_ESC);
+	tb_select_input_mode(TB_INPUT_ESC | TB_INPUT_FOCUS);
 	tb_select_output_mode(TB_OUTPUT_256);
+	screen_width = tb_width();
+	screen_height = tb_height();
+	// Only termbox output moves, input is still read on this thread
+	if (getenv("SLACK_RENDER_THREAD") != NULL) {
+		start_render_thread();
+	}
 
 	// Setup initial network connection
+	// IO buffer granularity can be tuned for slow or very fast links
+	const char* io_size = getenv("SLACK_IO_SIZE");
+	if (io_size != NULL && atoi(io_size) > 0) {
+		mg_io_size = atoi(io_size);
+	}
+	// How much of a long message shows before it's collapsed, 0 for all of it
+	const char* collapse = getenv("SLACK_COLLAPSE_LINES");
+	if (collapse != NULL) {
+		collapse_lines = MAX(atoi(collapse), 0);
+	}
+	start_workers();
+
 	ws_connection = NULL;
 	mg_mgr_init(&mgr);
-	mg_http_connect(&mgr, 
-			slack_rtm_connect_url,
-			handle_rtm_connect,
-			NULL);
+	// Metrics for monitoring, only on request and only on loopback since
+	// anyone who can reach the address can read them
+	const char* debug_listen = getenv("SLACK_DEBUG_LISTEN");
+	if (debug_listen != NULL) {
+		if (!is_loopback_url(debug_listen)) {
+			fprintf(errfile, "not listening on %s, SLACK_DEBUG_LISTEN has to be a loopback address\n",
+					debug_listen);
+		} else if (mg_http_listen(&mgr, debug_listen, handle_debug, NULL) == NULL) {
+			fprintf(errfile, "could not listen on %s\n", debug_listen);
+		}
+	}
+	bootstrap();
+	mg_timer_init(&indicator_timer, INDICATOR_REPAINT_MS, MG_TIMER_REPEAT,
+			indicator_tick, NULL);
 
 	// Render at least once on startup
 	render(); 
 
+	bool render_pending = false;
+	unsigned long last_render = 0;
 	quit = false;
 	while (!quit) {
-		mg_mgr_poll(&mgr, 10);
+		// Don't wait around while there's a backlog to get through
+		int timeout = state_updates_pending() ? 0 : 10;
+		int input_timeout = timeout;
+		// In the background the network can wait a little, but focus
+		// coming back can't, so all the waiting is done on the terminal
+		if (!focused && timeout > 0) {
+			timeout = 0;
+			input_timeout = UNFOCUSED_POLL_MS;
+		}
+		mg_mgr_poll(&mgr, timeout);
+		run_completed_tasks();
 
+		// Handle all waiting input before any more background updates
 		struct tb_event evt;
-		if (tb_peek_event(&evt, 10) > 0) {
+		handling_input = true;
+		while (tb_peek_event(&evt, input_timeout) > 0) {
+			unsigned long start = micros();
 			handle_event(&evt);
+			record_latency(&input_latency, micros() - start);
+			input_timeout = 0;
 		}
+		handling_input = false;
 		
-		if (process_state_update_queue()) {
+		if (process_state_update_queue(STATE_UPDATE_BUDGET_MS)) {
+			render_pending = true;
+		}
+		if (render_pending && (focused || mg_millis() - last_render >= UNFOCUSED_FRAME_MS)) {
+			unsigned long start = micros();
 			render();
+			record_latency(&render_latency, micros() - start);
+			last_render = mg_millis();
+			render_pending = false;
 		}
 	}
 
+	persist_input_buffers(NULL);
+	stop_workers();
+	stop_render_thread();
 	cleanup();
+	if (check_query_plans) {
+		return report_query_plans();
+	}
 	return 0;
 }
@@ -1193,6 +1193,8 @@ struct mg_connection *mg_http_listen(struct mg_mgr *mgr, const char *url,
 
 #include <string.h>
 
+size_t mg_io_size = MG_IO_SIZE;
+
 void mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
   if (new_size == 0) {
     free(io->buf);
@@ -2619,7 +2621,7 @@ static int ll_write(struct mg_connection *c, const void *buf, int len,
 int mg_send(struct mg_connection *c, const void *buf, size_t len) {
   int fail, n = c->is_udp
                     ? ll_write(c, buf, (SOCKET) len, &fail)
-                    : (int) mg_iobuf_append(&c->send, buf, len, MG_IO_SIZE);
+                    : (int) mg_iobuf_append(&c->send, buf, len, mg_io_size);
   return n;
 }
 
@@ -2688,30 +2690,53 @@ SOCKET mg_open_listener(const char *url) {
 
 static void read_conn(struct mg_connection *c,
                       int (*fn)(struct mg_connection *, void *, int, int *)) {
-  unsigned char *buf;
-  int rc, len, fail;
-
-  // NOTE(lsm): do only one iteration of reads, cause some systems
-  // (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data
-  if (c->recv.size - c->recv.len < MG_IO_SIZE &&
-      c->recv.size < MG_MAX_RECV_BUF_SIZE) {
-    mg_iobuf_resize(&c->recv, c->recv.size + MG_IO_SIZE);
-  }
-  buf = c->recv.buf + c->recv.len;
-  len = (int) (c->recv.size - c->recv.len);
-  rc = fn(c, buf, len, &fail);
-  if (rc > 0) {
-    struct mg_str evd = mg_str_n((char *) buf, rc);
+  size_t start = c->recv.len, budget = MG_READ_BUDGET;
+  int rc, len, fail = 0, full = 0;
+
+  // Drain the connection until it would block, bounded by the read budget so
+  // one busy connection cannot starve the rest. TLS reads return at most one
+  // record, so this also picks up anything OpenSSL has already buffered.
+  // NOTE(lsm): some systems (e.g. FreeRTOS stack) return 0 instead of
+  // -1/EWOULDBLOCK when no data, rc <= 0 ends the loop either way
+  while (budget > 0) {
+    if (c->recv.size - c->recv.len < mg_io_size &&
+        c->recv.size < MG_MAX_RECV_BUF_SIZE) {
+      // Grow geometrically: mg_iobuf_resize() copies the whole buffer
+      size_t new_size = c->recv.size * 2;
+      if (new_size < c->recv.size + mg_io_size) {
+        new_size = c->recv.size + mg_io_size;
+      }
+      if (new_size > MG_MAX_RECV_BUF_SIZE) new_size = MG_MAX_RECV_BUF_SIZE;
+      mg_iobuf_resize(&c->recv, new_size);
+    }
+    len = (int) (c->recv.size - c->recv.len);
+    if (len == 0) {
+      full = 1;
+      break;
+    }
+    if ((size_t) len > budget) len = (int) budget;
+    rc = fn(c, c->recv.buf + c->recv.len, len, &fail);
+    if (rc <= 0) break;
     c->recv.len += rc;
+    c->bytes_read += rc;
+    budget -= rc;
+  }
+  if (c->recv.len > start) {
+    struct mg_str evd =
+        mg_str_n((char *) c->recv.buf + start, c->recv.len - start);
     mg_call(c, MG_EV_READ, &evd);
-  } else {
-    if (fail) c->is_closing = 1;
+  }
+  if (fail) {
+    c->is_closing = 1;
+  } else if (full && c->recv.len == c->recv.size) {
+    mg_error(c, "recv buffer full, %lu bytes", (unsigned long) c->recv.size);
   }
 }
 
 static int write_conn(struct mg_connection *c) {
   int fail, rc = ll_write(c, c->send.buf, (SOCKET) c->send.len, &fail);
   if (rc > 0) {
+    c->bytes_written += rc;
     mg_iobuf_delete(&c->send, rc);
     if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
     mg_call(c, MG_EV_WRITE, &rc);
@@ -2952,10 +2977,11 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
   FD_ZERO(&wset);
 
   for (c = mgr->conns; c != NULL; c = c->next) {
-    // c->is_writable = 0;
-    // TLS might have stuff buffered, so dig everything
-    // c->is_readable = c->is_tls && c->is_readable ? 1 : 0;
     if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
+    // Decrypted TLS data is invisible to select(), don't wait for the socket
+    if (c->is_tls && !c->is_tls_hs && mg_tls_pending(c) > 0) {
+      tv.tv_sec = tv.tv_usec = 0;
+    }
     FD_SET(FD(c), &rset);
     if (FD(c) > maxfd) maxfd = FD(c);
     if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
@@ -2969,10 +2995,9 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
   }
 
   for (c = mgr->conns; c != NULL; c = c->next) {
-    // TLS might have stuff buffered, so dig everything
-    c->is_readable = c->is_tls && c->is_readable
-                         ? 1
-                         : FD(c) != INVALID_SOCKET && FD_ISSET(FD(c), &rset);
+    c->is_readable = FD(c) != INVALID_SOCKET &&
+                     (FD_ISSET(FD(c), &rset) ||
+                      (c->is_tls && !c->is_tls_hs && mg_tls_pending(c) > 0));
     c->is_writable = FD(c) != INVALID_SOCKET && FD_ISSET(FD(c), &wset);
   }
 #endif
@@ -3418,6 +3443,11 @@ int mg_tls_send(struct mg_connection *c, const void *buf, size_t len,
   return n;
 }
 
+int mg_tls_pending(struct mg_connection *c) {
+  struct mg_tls *tls = (struct mg_tls *) c->tls;
+  return tls == NULL ? 0 : (int) mbedtls_ssl_get_bytes_avail(&tls->ssl);
+}
+
 int mg_tls_free(struct mg_connection *c) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
   if (tls == NULL) return 0;
@@ -3587,6 +3617,11 @@ int mg_tls_send(struct mg_connection *c, const void *buf, size_t len,
   return n;
 }
 
+int mg_tls_pending(struct mg_connection *c) {
+  struct mg_tls *tls = (struct mg_tls *) c->tls;
+  return tls == NULL ? 0 : SSL_pending(tls->ssl);
+}
+
 #else  //////////////////////////////////////////   NO TLS
 
 int mg_tls_init(struct mg_connection *c, struct mg_tls_opts *opts) {
@@ -3609,6 +3644,10 @@ int mg_tls_send(struct mg_connection *c, const void *buf, size_t len,
   *fail = 1;
   return c == NULL || buf == NULL || len == 0 ? 0 : -1;
 }
+int mg_tls_pending(struct mg_connection *c) {
+  (void) c;
+  return 0;
+}
 
 #endif
 
@@ -330,11 +330,17 @@ typedef int socklen_t;
 #define MG_ENABLE_SOCKETPAIR 0
 #endif
 
-// Granularity of the send/recv IO buffer growth
+// Default granularity of the send/recv IO buffer growth, see mg_io_size
 #ifndef MG_IO_SIZE
 #define MG_IO_SIZE 512
 #endif
 
+// Maximum number of bytes read from a single connection per mg_mgr_poll(),
+// so that one busy connection cannot starve the others
+#ifndef MG_READ_BUDGET
+#define MG_READ_BUDGET (256 * 1024)
+#endif
+
 // Maximum size of the recv IO buffer
 #ifndef MG_MAX_RECV_BUF_SIZE
 #define MG_MAX_RECV_BUF_SIZE (3 * 1024 * 1024)
@@ -498,6 +504,8 @@ struct mg_iobuf {
   size_t size, len;
 };
 
+extern size_t mg_io_size;  // IO buffer granularity, MG_IO_SIZE by default
+
 void mg_iobuf_init(struct mg_iobuf *, size_t);
 void mg_iobuf_resize(struct mg_iobuf *, size_t);
 void mg_iobuf_free(struct mg_iobuf *);
@@ -619,6 +627,8 @@ struct mg_connection {
   void *pfn_data;              // Protocol-specific function parameter
   char label[32];              // Arbitrary label
   void *tls;                   // TLS specific data
+  size_t bytes_read;           // Total bytes received, after TLS
+  size_t bytes_written;        // Total bytes sent, before TLS
   unsigned is_listening : 1;   // Listening connection
   unsigned is_client : 1;      // Outbound (client) connection
   unsigned is_accepted : 1;    // Accepted (server) connection
@@ -720,6 +730,7 @@ int mg_tls_free(struct mg_connection *);
 int mg_tls_send(struct mg_connection *, const void *buf, size_t len, int *fail);
 int mg_tls_recv(struct mg_connection *, void *buf, size_t len, int *fail);
 int mg_tls_handshake(struct mg_connection *);
+int mg_tls_pending(struct mg_connection *);
 
 
 #define WEBSOCKET_OP_CONTINUE 0
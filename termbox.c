@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +19,8 @@
 
 #define ENTER_MOUSE_SEQ "\x1b[?1000h\x1b[?1002h\x1b[?1015h\x1b[?1006h"
 #define EXIT_MOUSE_SEQ "\x1b[?1006l\x1b[?1015l\x1b[?1002l\x1b[?1000l"
+#define ENTER_FOCUS_SEQ "\x1b[?1004h"
+#define EXIT_FOCUS_SEQ "\x1b[?1004l"
 #define EUNSUPPORTED_TERM -1
 #define TI_MAGIC 0432
 #define TI_ALT_MAGIC 542
@@ -120,7 +123,17 @@ static uint16_t background = TB_DEFAULT;
 static uint16_t foreground = TB_DEFAULT;
 
 /* may happen in a different thread */
-static volatile int buffer_size_change_request;
+static int buffer_size_change_request;
+static pthread_mutex_t buffer_size_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* clears the request, returns whether there was one */
+static int take_buffer_size_change_request(void) {
+    pthread_mutex_lock(&buffer_size_lock);
+    int request = buffer_size_change_request;
+    buffer_size_change_request = 0;
+    pthread_mutex_unlock(&buffer_size_lock);
+    return request;
+}
 
 // rxvt-256color
 static const char *rxvt_256color_keys[] = {
@@ -614,6 +627,14 @@ static int parse_escape_seq(struct tb_event *event, const char *buf, int len) {
     if (mouse_parsed != 0)
         return mouse_parsed;
 
+    if ((inputmode & TB_INPUT_FOCUS) &&
+        (starts_with(buf, len, "\033[I") || starts_with(buf, len, "\033[O"))) {
+        event->type = TB_EVENT_FOCUS; // TB_EVENT_KEY by default
+        event->ch = 0;
+        event->key = buf[2] == 'I' ? TB_KEY_FOCUS_IN : TB_KEY_FOCUS_OUT;
+        return 3;
+    }
+
     // it's pretty simple here, find 'starts_with' match and return
     // success, else return failure
     int i;
@@ -767,6 +788,7 @@ void tb_shutdown(void) {
     bytebuffer_puts(&output_buffer, funcs[T_EXIT_CA]);
     bytebuffer_puts(&output_buffer, funcs[T_EXIT_KEYPAD]);
     bytebuffer_puts(&output_buffer, funcs[T_EXIT_MOUSE]);
+    bytebuffer_puts(&output_buffer, EXIT_FOCUS_SEQ);
     bytebuffer_flush(&output_buffer, inout);
     tcsetattr(inout, TCSAFLUSH, &orig_tios);
 
@@ -790,9 +812,10 @@ void tb_present(void) {
     lastx = LAST_COORD_INIT;
     lasty = LAST_COORD_INIT;
 
-    if (buffer_size_change_request) {
+    // Cleared before the size is read, so a resize that arrives while
+    // presenting on another thread isn't lost
+    if (take_buffer_size_change_request()) {
         update_size();
-        buffer_size_change_request = 0;
     }
 
     for (y = 0; y < front_buffer.height; ++y) {
@@ -907,9 +930,10 @@ int tb_width(void) { return termw; }
 int tb_height(void) { return termh; }
 
 void tb_clear(void) {
-    if (buffer_size_change_request) {
+    // Cleared before the size is read, so a resize that arrives while
+    // presenting on another thread isn't lost
+    if (take_buffer_size_change_request()) {
         update_size();
-        buffer_size_change_request = 0;
     }
     cellbuf_clear(&back_buffer);
 }
@@ -933,6 +957,12 @@ int tb_select_input_mode(int mode) {
             bytebuffer_puts(&output_buffer, funcs[T_EXIT_MOUSE]);
             bytebuffer_flush(&output_buffer, inout);
         }
+        if (mode & TB_INPUT_FOCUS) {
+            bytebuffer_puts(&output_buffer, ENTER_FOCUS_SEQ);
+        } else {
+            bytebuffer_puts(&output_buffer, EXIT_FOCUS_SEQ);
+        }
+        bytebuffer_flush(&output_buffer, inout);
     }
     return inputmode;
 }
@@ -1264,7 +1294,9 @@ static int wait_fill_event(struct tb_event *event, struct timeval *timeout) {
             event->type = TB_EVENT_RESIZE;
             int zzz = 0;
             read(winch_fds[0], &zzz, sizeof(int));
+            pthread_mutex_lock(&buffer_size_lock);
             buffer_size_change_request = 1;
+            pthread_mutex_unlock(&buffer_size_lock);
             get_term_size(&event->w, &event->h);
             return TB_EVENT_RESIZE;
         }
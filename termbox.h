@@ -47,6 +47,8 @@ extern "C" {
 #define TB_KEY_MOUSE_RELEASE    (0xFFFF - 25)
 #define TB_KEY_MOUSE_WHEEL_UP   (0xFFFF - 26)
 #define TB_KEY_MOUSE_WHEEL_DOWN (0xFFFF - 27)
+#define TB_KEY_FOCUS_IN         (0xFFFF - 28)
+#define TB_KEY_FOCUS_OUT        (0xFFFF - 29)
 
 /* These are all ASCII code points below SPACE character and a BACKSPACE key. */
 #define TB_KEY_CTRL_TILDE       0x00
@@ -144,12 +146,13 @@ struct tb_cell {
 #define TB_EVENT_KEY    1
 #define TB_EVENT_RESIZE 2
 #define TB_EVENT_MOUSE  3
+#define TB_EVENT_FOCUS  4
 
 /* An event, single interaction from the user. The 'mod' and 'ch' fields are
  * valid if 'type' is TB_EVENT_KEY. The 'w' and 'h' fields are valid if 'type'
  * is TB_EVENT_RESIZE. The 'x' and 'y' fields are valid if 'type' is
- * TB_EVENT_MOUSE. The 'key' field is valid if 'type' is either TB_EVENT_KEY
- * or TB_EVENT_MOUSE. The fields 'key' and 'ch' are mutually exclusive; only
+ * TB_EVENT_MOUSE. The 'key' field is valid if 'type' is TB_EVENT_KEY,
+ * TB_EVENT_MOUSE or TB_EVENT_FOCUS. The fields 'key' and 'ch' are mutually exclusive; only
  * one of them can be non-zero at a time.
  */
 struct tb_event {
@@ -234,6 +237,7 @@ SO_IMPORT struct tb_cell *tb_cell_buffer(void);
 #define TB_INPUT_ESC     1 /* 001 */
 #define TB_INPUT_ALT     2 /* 010 */
 #define TB_INPUT_MOUSE   4 /* 100 */
+#define TB_INPUT_FOCUS   8 /* 1000 */
 
 /* Sets the termbox input mode. Termbox has two input modes:
  * 1. Esc input mode.
@@ -249,6 +253,10 @@ SO_IMPORT struct tb_cell *tb_cell_buffer(void);
  * reason you've decided to use (TB_INPUT_ESC | TB_INPUT_ALT) combination, it
  * will behave as if only TB_INPUT_ESC was selected.
  *
+ * TB_INPUT_FOCUS can be applied the same way. The terminal then reports when
+ * it gains or loses focus, as TB_EVENT_FOCUS events with TB_KEY_FOCUS_IN or
+ * TB_KEY_FOCUS_OUT keys.
+ *
  * If 'mode' is TB_INPUT_CURRENT, it returns the current input mode.
  *
  * Default termbox input mode is TB_INPUT_ESC.